@@ -102,6 +102,28 @@ int svd_rank(const SVDPtr& svd, double threshold) {
     return rank;
 }
 
+std::vector<double> singular_values(const SVDPtr& svd) {
+    return svd->singular_values;
+}
+
+std::vector<double> left_singular_vectors(const SVDPtr& svd, int n_vectors) {
+    auto& U = svd->left_singular_vectors;
+    size_t m = std::lround(std::sqrt(U.size()));
+    return std::vector<double>(U.begin(), U.begin() + n_vectors * m);
+}
+
+std::vector<double> right_singular_vectors(const SVDPtr& svd, int n_vectors) {
+    auto& VT = svd->right_singular_vectors;
+    size_t n = std::lround(std::sqrt(VT.size()));
+    std::vector<double> out(n_vectors * n);
+    for (int i = 0; i < n_vectors; i++) {
+        for (size_t j = 0; j < n; j++) {
+            out[i * n + j] = VT[j * n + i];
+        }
+    }
+    return out;
+}
+
 std::vector<double> mat_mult(int n_out_rows, int n_out_cols,
     bool transposeA, std::vector<double>& A,
     bool transposeB, std::vector<double>& B)
@@ -184,6 +206,22 @@ void matrix_vector_product(double* matrix, int n_rows, int n_cols,
         &n_cols, vector, &inc, &beta, out, &inc);
 }
 
+void batch_matrix_vector_product(double* matrix, int n_rows, int n_cols,
+    double* vectors, int n_vectors, double* out, double scale)
+{
+    if (n_cols == 0 || n_vectors == 0) {
+        return;
+    }
+    char transa = 'T';
+    char transb = 'N';
+    double alpha = scale;
+    double beta = 1.0;
+    // Row-major vectors and products are column-major with one vector per
+    // column, so this is out = matrix * vectors in BLAS terms.
+    dgemm_(&transa, &transb, &n_rows, &n_vectors, &n_cols, &alpha, matrix,
+        &n_cols, vectors, &n_cols, &beta, out, &n_rows);
+}
+
 std::vector<double> matrix_vector_product(double* matrix, int n_rows,
     int n_cols, double* vector)
 {
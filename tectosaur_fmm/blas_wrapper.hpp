@@ -22,6 +22,13 @@ std::vector<double> qr_pseudoinverse(double* matrix, int m, int n);
 SVDPtr svd_decompose(double* matrix, int m, int n);
 void set_threshold(const SVDPtr& svd, double threshold);
 int svd_rank(const SVDPtr& svd, double threshold);
+std::vector<double> singular_values(const SVDPtr& svd);
+// svd_decompose follows LAPACK and treats the matrix as column-major. Returns
+// the first n_vectors left singular vectors as the rows of a row-major
+// (n_vectors x m) matrix.
+std::vector<double> left_singular_vectors(const SVDPtr& svd, int n_vectors);
+// The first n_vectors right singular vectors, in the same layout.
+std::vector<double> right_singular_vectors(const SVDPtr& svd, int n_vectors);
 std::vector<double> svd_solve(const SVDPtr& svd, const std::vector<double>& b);
 double condition_number(const SVDPtr& svd); 
 
@@ -32,6 +39,10 @@ void matrix_vector_product(double* matrix, int n_rows, int n_cols,
     double* vector, double* out);
 std::vector<double> matrix_vector_product(double* matrix, int n_rows,
     int n_cols, double* vector);
+// Adds scale times the product of the matrix with each row of vectors
+// (n_vectors x n_cols) to the same row of out (n_vectors x n_rows).
+void batch_matrix_vector_product(double* matrix, int n_rows, int n_cols,
+    double* vectors, int n_vectors, double* out, double scale = 1.0);
 
 struct Block {
     size_t row_start;
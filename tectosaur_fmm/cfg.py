@@ -56,10 +56,12 @@ def lib_cfg(cfg):
         '-std=c++14', '-O3', '-g', '-Wall', '-Werror', '-fopenmp', '-UNDEBUG', '-DDEBUG'
     ]
     cfg['sources'] += to_fmm_dir([
-        'fmm_impl.cpp', 'blas_wrapper.cpp', 'fmm_kernels.cpp', 'octree.cpp'
+        'fmm_impl.cpp', 'blas_wrapper.cpp', 'fmm_kernels.cpp', 'octree.cpp', 'kdtree.cpp',
+        'op_cache.cpp'
     ])
     cfg['dependencies'] += to_fmm_dir([
-        'fmm_impl.hpp', 'octree.hpp', 'blas_wrapper.hpp',
+        'fmm_impl.hpp', 'octree.hpp', 'kdtree.hpp', 'blas_wrapper.hpp', 'fft.hpp',
+        'op_cache.hpp',
         os.path.join(tectosaur.source_dir, 'include', 'pybind11_nparray.hpp'),
         'cfg.py'
     ])
@@ -72,7 +74,8 @@ def lib_cfg(cfg):
 
 def test_cfg(cfg):
     lib_cfg(cfg)
-    cfg['sources'] += ['test_blas.cpp', 'test_octree.cpp']
+    cfg['sources'] += ['test_blas.cpp', 'test_octree.cpp', 'test_kdtree.cpp', 'test_fft.cpp',
+        'test_op_cache.cpp', 'test_kernels.cpp']
     cfg['dependencies'] += ['test_helpers.hpp', 'doctest.h']
     cfg['include_dirs'] += [tectosaur_fmm.source_dir]
     template_kernels(cfg)
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <vector>
+
+// A small mixed radix FFT for the m2l convolutions. Any size works, but sizes
+// with only small prime factors are fastest. The inverse is not scaled.
+class FFT {
+public:
+    typedef std::complex<double> Complex;
+
+    explicit FFT(size_t n):
+        n(n),
+        twiddles(n)
+    {
+        for (size_t k = 0; k < n; k++) {
+            double theta = -2 * M_PI * k / static_cast<double>(n);
+            twiddles[k] = Complex(std::cos(theta), std::sin(theta));
+        }
+    }
+
+    size_t size() const { return n; }
+
+    // sum + a * b, without the inf and nan handling of the std::complex
+    // product, which is several times slower.
+    static Complex mul_add(const Complex& sum, const Complex& a, const Complex& b) {
+        return Complex(
+            sum.real() + a.real() * b.real() - a.imag() * b.imag(),
+            sum.imag() + a.real() * b.imag() + a.imag() * b.real()
+        );
+    }
+
+    // Transforms the n values data[0], data[stride], ... in place.
+    void forward(Complex* data, size_t stride) const {
+        transform(data, stride, false);
+    }
+
+    void inverse(Complex* data, size_t stride) const {
+        transform(data, stride, true);
+    }
+
+    // Transforms a row-major grid with n values along each of dim axes.
+    void forward_grid(Complex* data, size_t dim) const {
+        transform_grid(data, dim, false);
+    }
+
+    void inverse_grid(Complex* data, size_t dim) const {
+        transform_grid(data, dim, true);
+    }
+
+private:
+    size_t n;
+    std::vector<Complex> twiddles;
+
+    // The work space holds the gathered input, the output and the values
+    // combined in each step, 3n values in total.
+    void transform(Complex* data, size_t stride, bool inverse) const {
+        std::vector<Complex> work(3 * n);
+        transform(data, stride, inverse, work.data());
+    }
+
+    void transform(Complex* data, size_t stride, bool inverse, Complex* work) const {
+        Complex* in = work;
+        Complex* out = work + n;
+        for (size_t i = 0; i < n; i++) {
+            in[i] = data[i * stride];
+        }
+        recurse(in, 1, out, n, 1, inverse, work + 2 * n);
+        for (size_t i = 0; i < n; i++) {
+            data[i * stride] = out[i];
+        }
+    }
+
+    void transform_grid(Complex* data, size_t dim, bool inverse) const {
+        std::vector<Complex> work(3 * n);
+        size_t total = 1;
+        for (size_t d = 0; d < dim; d++) {
+            total *= n;
+        }
+        // Along each axis, the lines start at every index whose coordinate
+        // on that axis is zero.
+        size_t stride = total;
+        for (size_t d = 0; d < dim; d++) {
+            stride /= n;
+            for (size_t start = 0; start < total; start++) {
+                if ((start / stride) % n != 0) {
+                    continue;
+                }
+                transform(&data[start], stride, inverse, work.data());
+            }
+        }
+    }
+
+    // Decimation in time: splits the len values into the r subsequences of
+    // every r-th value, transforms those, and combines them.
+    void recurse(const Complex* in, size_t stride, Complex* out, size_t len,
+        size_t tw_stride, bool inverse, Complex* sub) const
+    {
+        size_t r = smallest_factor(len);
+        size_t m = len / r;
+        if (m == 1) {
+            for (size_t q = 0; q < r; q++) {
+                out[q] = in[q * stride];
+            }
+        } else {
+            for (size_t q = 0; q < r; q++) {
+                recurse(in + q * stride, stride * r, out + q * m, m, tw_stride * r, inverse, sub);
+            }
+        }
+
+        if (r == 2) {
+            for (size_t k = 0; k < m; k++) {
+                auto a = out[k];
+                auto wb = mul_add(0.0, twiddle(k * tw_stride, inverse), out[m + k]);
+                out[k] = a + wb;
+                out[m + k] = a - wb;
+            }
+            return;
+        }
+
+        for (size_t k0 = 0; k0 < m; k0++) {
+            for (size_t q = 0; q < r; q++) {
+                sub[q] = out[q * m + k0];
+            }
+            for (size_t s = 0; s < r; s++) {
+                size_t k = k0 + s * m;
+                Complex sum = sub[0];
+                size_t power = 0;
+                for (size_t q = 1; q < r; q++) {
+                    // power = q * k mod len
+                    power += k;
+                    if (power >= len) {
+                        power -= len;
+                    }
+                    sum = mul_add(sum, twiddle(power * tw_stride, inverse), sub[q]);
+                }
+                out[k] = sum;
+            }
+        }
+    }
+
+    const Complex& twiddle(size_t idx, bool inverse) const {
+        return twiddles[inverse && idx != 0 ? n - idx : idx];
+    }
+
+    static size_t smallest_factor(size_t len) {
+        for (size_t f = 2; f * f <= len; f++) {
+            if (len % f == 0) {
+                return f;
+            }
+        }
+        return len;
+    }
+};
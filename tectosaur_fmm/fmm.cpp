@@ -8,17 +8,241 @@ lib_cfg(cfg)
 #include <pybind11/stl.h>
 #include <pybind11/functional.h>
 
+#include <stdexcept>
+
 
 #include "fmm_impl.hpp"
 #include "octree.hpp"
+#include "kdtree.hpp"
 
 namespace py = pybind11;
 
+// An (n, dim) array over the coordinate-major storage of SoAPts.
+template <size_t dim>
+py::array soa_pts_array(const SoAPts<dim>& pts) {
+    return py::array(py::buffer_info(
+        const_cast<double*>(pts.xs.data()), sizeof(double),
+        py::format_descriptor<double>::value, 2,
+        {pts.size(), dim}, {sizeof(double), pts.size() * sizeof(double)}
+    ));
+}
+
+template <size_t dim, typename TreeT>
+void check_refit_shape(const TreeT& tree, NPArrayD& arr) {
+    check_shape<dim>(arr);
+    if (static_cast<size_t>(arr.request().shape[0]) != tree.n_pts) {
+        throw std::runtime_error("refit needs the same number of points as the tree");
+    }
+}
+
+// A read only handle on a tree shared with an FMMMat, so that python can look
+// at the matrix's trees without changing them under its interaction lists.
+template <typename TreeT>
+struct ConstTree {
+    std::shared_ptr<const TreeT> tree;
+};
+
+// The read only members of a tree, for both the tree classes and their
+// ConstTree views. get returns the tree of a python object of type T.
+template <typename T, typename ClassT, typename GetT>
+ClassT& def_tree_members(ClassT& cls, GetT get) {
+    return cls
+        .def("root", [get] (const T& t) { return get(t).root(); })
+        .def_property_readonly("nodes", [get] (const T& t) { return get(t).nodes; })
+        .def_property_readonly("orig_idxs", [get] (const T& t) { return get(t).orig_idxs; })
+        .def_property_readonly("max_height", [get] (const T& t) { return get(t).max_height; })
+        .def_property_readonly("level_starts", [get] (const T& t) {
+            return get(t).level_starts;
+        })
+        .def_property_readonly("pts", [get] (const T& t) {
+            return soa_pts_array(get(t).pts);
+        })
+        .def_property_readonly("normals", [get] (const T& t) {
+            return soa_pts_array(get(t).normals);
+        })
+        .def_property_readonly("n_nodes", [get] (const T& t) {
+            return get(t).nodes.size();
+        });
+}
+
+template <typename TreeT>
+py::class_<TreeT,std::shared_ptr<TreeT>> wrap_tree(py::module& m, std::string tree_name, std::string node_name) {
+    const size_t dim = TreeT::spatial_dim;
+    typedef typename TreeT::Node Node;
+
+    py::class_<Node>(m, node_name.c_str())
+        .def_readonly("start", &Node::start)
+        .def_readonly("end", &Node::end)
+        .def_readonly("bounds", &Node::bounds)
+        .def_readonly("is_leaf", &Node::is_leaf)
+        .def_readonly("idx", &Node::idx)
+        .def_readonly("height", &Node::height)
+        .def_readonly("depth", &Node::depth)
+        .def_readonly("bounds_level", &Node::bounds_level)
+        .def_readonly("first_child", &Node::first_child)
+        .def_property_readonly("children", [] (Node& n) {
+            std::vector<size_t> out;
+            for (auto child_idx: n.children()) {
+                out.push_back(child_idx);
+            }
+            return out;
+        });
+
+    py::class_<ConstTree<TreeT>> view(m, (tree_name + "View").c_str());
+    def_tree_members<ConstTree<TreeT>>(view, [] (const ConstTree<TreeT>& v) -> const TreeT& {
+        return *v.tree;
+    });
+
+    // Trees are held by shared_ptr so that an FMMMat can share them with
+    // python instead of copying. A shared tree must not change, so refit
+    // returns a refit copy, or None if the points could not be refit.
+    py::class_<TreeT,std::shared_ptr<TreeT>> cls(m, tree_name.c_str());
+    def_tree_members<TreeT>(cls, [] (const TreeT& t) -> const TreeT& { return t; });
+    return cls
+        .def("refit", [] (const TreeT& tree, NPArrayD np_pts, NPArrayD np_normals) {
+            check_refit_shape<dim>(tree, np_pts);
+            check_refit_shape<dim>(tree, np_normals);
+            auto out = std::make_shared<TreeT>(tree);
+            if (!out->refit(
+                    as_ptr<std::array<double,dim>>(np_pts),
+                    as_ptr<std::array<double,dim>>(np_normals)))
+            {
+                return std::shared_ptr<TreeT>();
+            }
+            return out;
+        });
+}
+
+template <typename TreeT>
+void wrap_fmm_mat(py::module& m, std::string name) {
+#define EVALFNC(FNCNAME)\
+        def(#FNCNAME"_eval", [] (FMMMat<TreeT>& m, NPArrayD out, NPArrayD in) {\
+            auto* out_ptr = reinterpret_cast<double*>(out.request().ptr);\
+            auto* in_ptr = reinterpret_cast<double*>(in.request().ptr);\
+            std::unique_lock<std::shared_timed_mutex> lock(*m.state_mutex);\
+            m.FNCNAME##_matvec(out_ptr, in_ptr);\
+        })
+#define EVALFNCLEVEL(FNCNAME)\
+        def(#FNCNAME"_eval", [] (FMMMat<TreeT>& m, NPArrayD out, NPArrayD in, int level) {\
+            auto* out_ptr = reinterpret_cast<double*>(out.request().ptr);\
+            auto* in_ptr = reinterpret_cast<double*>(in.request().ptr);\
+            std::unique_lock<std::shared_timed_mutex> lock(*m.state_mutex);\
+            m.FNCNAME##_matvec(out_ptr, in_ptr, level);\
+        })
+#define OP(NAME)\
+        def_readonly(#NAME, &FMMMat<TreeT>::NAME)
+
+    py::class_<FMMMat<TreeT>>(m, name.c_str())
+        .def_property_readonly("obs_tree", [] (FMMMat<TreeT>& m) {
+            return ConstTree<TreeT>{m.obs_tree};
+        })
+        .def_property_readonly("src_tree", [] (FMMMat<TreeT>& m) {
+            return ConstTree<TreeT>{m.src_tree};
+        })
+        .def_property_readonly("self_interaction", &FMMMat<TreeT>::self_interaction)
+        .def_readonly("pruned", &FMMMat<TreeT>::pruned)
+        .def_property_readonly("n_m2l_ops", [] (FMMMat<TreeT>& m) {
+            return m.m2l_ops.size();
+        })
+        .def_property_readonly("n_m2l_fft_ops", [] (FMMMat<TreeT>& m) {
+            return m.m2l_fft_ops.size();
+        })
+        .def_property_readonly("m2l_svd_ranks", [] (FMMMat<TreeT>& m) {
+            std::vector<int> ranks;
+            for (auto& b: m.m2l_bases) {
+                ranks.push_back(b.rank);
+            }
+            return ranks;
+        })
+        .def_property_readonly("surf", [] (FMMMat<TreeT>& m) {
+            return soa_pts_array(m.surf);
+        })
+        .def_readonly("cfg", &FMMMat<TreeT>::cfg)
+        .def_property_readonly("u2e_ops", [] (FMMMat<TreeT>& fmm) {
+            int n_rows = fmm.tensor_dim() * fmm.surf.size();
+            return array_from_vector(dense_c2e_ops(fmm.u2e_ops, n_rows));
+        })
+        .def_property_readonly("u2e_ranks", [] (FMMMat<TreeT>& fmm) {
+            std::vector<int> ranks;
+            for (auto& op: fmm.u2e_ops) {
+                ranks.push_back(fmm.c2e_rank(op));
+            }
+            return ranks;
+        })
+        .def_property_readonly("d2e_ops", [] (FMMMat<TreeT>& fmm) {
+            int n_rows = fmm.tensor_dim() * fmm.surf.size();
+            return array_from_vector(dense_c2e_ops(fmm.d2e_ops, n_rows));
+        })
+        .def_property_readonly("d2e_ranks", [] (FMMMat<TreeT>& fmm) {
+            std::vector<int> ranks;
+            for (auto& op: fmm.d2e_ops) {
+                ranks.push_back(fmm.c2e_rank(op));
+            }
+            return ranks;
+        })
+        .def_property_readonly("n_mapped_c2e_ops", [] (FMMMat<TreeT>& fmm) {
+            int n = 0;
+            for (auto* ops: {&fmm.u2e_ops, &fmm.d2e_ops}) {
+                for (auto& op: *ops) {
+                    n += op.mapped();
+                }
+            }
+            return n;
+        })
+        .def_readonly("u2e_scales", &FMMMat<TreeT>::u2e_scales)
+        .def_readonly("d2e_scales", &FMMMat<TreeT>::d2e_scales)
+        .def("c2e_op_idx", &FMMMat<TreeT>::c2e_op_idx)
+        .def_property_readonly("tensor_dim", &FMMMat<TreeT>::tensor_dim)
+        .def("refit", [] (FMMMat<TreeT>& m, NPArrayD obs_pts, NPArrayD obs_normals,
+                NPArrayD src_pts, NPArrayD src_normals)
+            {
+                // The GIL stays held, so the python properties never see a
+                // partly refit matrix. Evals release it and refit waits for
+                // them.
+                const size_t dim = TreeT::spatial_dim;
+                check_refit_shape<dim>(*m.obs_tree, obs_pts);
+                check_refit_shape<dim>(*m.obs_tree, obs_normals);
+                check_refit_shape<dim>(*m.src_tree, src_pts);
+                check_refit_shape<dim>(*m.src_tree, src_normals);
+                return m.refit(
+                    as_ptr<std::array<double,dim>>(obs_pts),
+                    as_ptr<std::array<double,dim>>(obs_normals),
+                    as_ptr<std::array<double,dim>>(src_pts),
+                    as_ptr<std::array<double,dim>>(src_normals)
+                );
+            })
+        .def("eval", [] (FMMMat<TreeT>& m, NPArrayD in) {
+            size_t n_in = m.tensor_dim() * m.src_tree->n_pts;
+            if (static_cast<size_t>(in.request().size) != n_in) {
+                throw std::runtime_error("eval needs tensor_dim values per src point");
+            }
+            std::vector<double> out(m.tensor_dim() * m.obs_tree->n_pts);
+            auto* in_ptr = as_ptr<double>(in);
+            {
+                py::gil_scoped_release release;
+                m.eval(out.data(), in_ptr);
+            }
+            return array_from_vector(out);
+        })
+        .OP(p2m).OP(m2m).OP(p2l).OP(m2l).OP(l2l).OP(p2p).OP(m2p).OP(l2p).OP(u2e).OP(d2e)
+        .EVALFNC(p2p).EVALFNC(p2m).EVALFNC(p2l).EVALFNC(m2l).EVALFNC(m2p).EVALFNC(l2p)
+        .EVALFNCLEVEL(m2m).EVALFNCLEVEL(u2e).EVALFNCLEVEL(l2l).EVALFNCLEVEL(d2e);
+
+#undef EXPOSEOP
+#undef EVALFNC
+#undef EVALFNCLEVEL
+}
+
 template <size_t dim>
 void wrap_dim(py::module& m) {
     m.def("surrounding_surface", surrounding_surface<dim>);
     m.def("inscribe_surf", &inscribe_surf<dim>);
-    m.def("c2e_solve", &c2e_solve<dim>);
+    m.def("c2e_solve", [] (std::vector<std::array<double,dim>> surf,
+            const Cube<dim>& bounds, double check_r, double equiv_r,
+            const FMMConfig<dim>& cfg)
+        {
+            return c2e_solve<dim>(surf, bounds, check_r, equiv_r, cfg);
+        });
 
     m.def("in_box", &in_box<dim>);
 
@@ -28,111 +252,89 @@ void wrap_dim(py::module& m) {
         .def_readonly("width", &Cube<dim>::width);
 
 
-    py::class_<OctreeNode<dim>>(m, "OctreeNode")
-        .def_readonly("start", &OctreeNode<dim>::start)
-        .def_readonly("end", &OctreeNode<dim>::end)
-        .def_readonly("bounds", &OctreeNode<dim>::bounds)
-        .def_readonly("is_leaf", &OctreeNode<dim>::is_leaf)
-        .def_readonly("idx", &OctreeNode<dim>::idx)
-        .def_readonly("height", &OctreeNode<dim>::height)
-        .def_readonly("depth", &OctreeNode<dim>::depth)
-        .def_readonly("children", &OctreeNode<dim>::children);
-
-    py::class_<Octree<dim>>(m, "Octree")
+    wrap_tree<Octree<dim>>(m, "Octree", "OctreeNode")
         .def("__init__",
-        [] (Octree<dim>& kd, NPArrayD np_pts, NPArrayD np_normals, size_t n_per_cell) {
+        [] (Octree<dim>& kd, NPArrayD np_pts, NPArrayD np_normals,
+            size_t n_per_cell, bool morton, bool adaptive_bounds, int max_depth) 
+        {
             check_shape<dim>(np_pts);
             check_shape<dim>(np_normals);
             new (&kd) Octree<dim>(
                 reinterpret_cast<std::array<double,dim>*>(np_pts.request().ptr),
                 reinterpret_cast<std::array<double,dim>*>(np_normals.request().ptr),
-                np_pts.request().shape[0], n_per_cell
-            );
-        })
-        .def("root", &Octree<dim>::root)
-        .def_readonly("nodes", &Octree<dim>::nodes)
-        .def_readonly("orig_idxs", &Octree<dim>::orig_idxs)
-        .def_readonly("max_height", &Octree<dim>::max_height)
-        .def_property_readonly("pts", [] (Octree<dim>& tree) {
-            return make_array<double>(
-                {tree.pts.size(), dim},
-                reinterpret_cast<double*>(tree.pts.data())
+                np_pts.request().shape[0], n_per_cell, morton, adaptive_bounds,
+                max_depth
             );
-        })
-        .def_property_readonly("normals", [] (Octree<dim>& tree) {
-            return make_array<double>(
-                {tree.normals.size(), dim},
-                reinterpret_cast<double*>(tree.normals.data())
+        }, py::arg("pts"), py::arg("normals"), py::arg("n_per_cell"),
+        py::arg("morton") = true, py::arg("adaptive_bounds") = false,
+        py::arg("max_depth") = Octree<dim>::default_max_depth);
+
+    wrap_tree<KDTree<dim>>(m, "KDTree", "KDNode")
+        .def("__init__",
+        [] (KDTree<dim>& kd, NPArrayD np_pts, NPArrayD np_normals,
+            size_t n_per_cell, bool spherical_bounds) 
+        {
+            check_shape<dim>(np_pts);
+            check_shape<dim>(np_normals);
+            new (&kd) KDTree<dim>(
+                reinterpret_cast<std::array<double,dim>*>(np_pts.request().ptr),
+                reinterpret_cast<std::array<double,dim>*>(np_normals.request().ptr),
+                np_pts.request().shape[0], n_per_cell, spherical_bounds
             );
-        })
-        .def_property_readonly("n_nodes", [] (Octree<dim>& o) {
-            return o.nodes.size();
-        });
+        }, py::arg("pts"), py::arg("normals"), py::arg("n_per_cell"),
+        py::arg("spherical_bounds") = false);
 
     py::class_<FMMConfig<dim>>(m, "FMMConfig")
         .def("__init__", 
             [] (FMMConfig<dim>& cfg, double equiv_r,
                 double check_r, size_t order, std::string k_name,
-                NPArrayD params) 
+                NPArrayD params, size_t m2l_cache_bytes, double m2l_svd_tol,
+                bool fft_m2l, size_t fft_m2l_bytes, double c2e_svd_tol,
+                std::string op_cache_dir)
             {
                 new (&cfg) FMMConfig<dim>{
                     equiv_r, check_r, order, get_by_name<dim>(k_name),
-                    get_vector<double>(params)                                    
+                    get_vector<double>(params), m2l_cache_bytes, m2l_svd_tol,
+                    fft_m2l, fft_m2l_bytes, c2e_svd_tol, op_cache_dir
                 };
-            }
+            }, py::arg("equiv_r"), py::arg("check_r"), py::arg("order"),
+            py::arg("k_name"), py::arg("params"),
+            py::arg("m2l_cache_bytes") = FMMConfig<dim>::default_m2l_cache_bytes,
+            py::arg("m2l_svd_tol") = 0.0, py::arg("fft_m2l") = false,
+            py::arg("fft_m2l_bytes") = FMMConfig<dim>::default_fft_m2l_bytes,
+            py::arg("c2e_svd_tol") = 0.0, py::arg("op_cache_dir") = ""
         )
         .def_readonly("inner_r", &FMMConfig<dim>::inner_r)
         .def_readonly("outer_r", &FMMConfig<dim>::outer_r)
         .def_readonly("order", &FMMConfig<dim>::order)
         .def_readonly("params", &FMMConfig<dim>::params)
+        .def_readonly("m2l_cache_bytes", &FMMConfig<dim>::m2l_cache_bytes)
+        .def_readonly("m2l_svd_tol", &FMMConfig<dim>::m2l_svd_tol)
+        .def_readonly("fft_m2l", &FMMConfig<dim>::fft_m2l)
+        .def_readonly("fft_m2l_bytes", &FMMConfig<dim>::fft_m2l_bytes)
+        .def_readonly("c2e_svd_tol", &FMMConfig<dim>::c2e_svd_tol)
+        .def_readonly("op_cache_dir", &FMMConfig<dim>::op_cache_dir)
         .def_property_readonly("kernel_name", &FMMConfig<dim>::kernel_name)
         .def_property_readonly("tensor_dim", &FMMConfig<dim>::tensor_dim);
 
-#define EVALFNC(FNCNAME)\
-        def(#FNCNAME"_eval", [] (FMMMat<dim>& m, NPArrayD out, NPArrayD in) {\
-            auto* out_ptr = reinterpret_cast<double*>(out.request().ptr);\
-            auto* in_ptr = reinterpret_cast<double*>(in.request().ptr);\
-            m.FNCNAME##_matvec(out_ptr, in_ptr);\
-        })
-#define EVALFNCLEVEL(FNCNAME)\
-        def(#FNCNAME"_eval", [] (FMMMat<dim>& m, NPArrayD out, NPArrayD in, int level) {\
-            auto* out_ptr = reinterpret_cast<double*>(out.request().ptr);\
-            auto* in_ptr = reinterpret_cast<double*>(in.request().ptr);\
-            m.FNCNAME##_matvec(out_ptr, in_ptr, level);\
-        })
-#define OP(NAME)\
-        def_readonly(#NAME, &FMMMat<dim>::NAME)
-
-    py::class_<FMMMat<dim>>(m, "FMMMat")
-        .def_readonly("obs_tree", &FMMMat<dim>::obs_tree)
-        .def_readonly("src_tree", &FMMMat<dim>::src_tree)
-        .def_readonly("surf", &FMMMat<dim>::surf)
-        .def_readonly("cfg", &FMMMat<dim>::cfg)
-        .def_property_readonly("u2e_ops", [] (FMMMat<dim>& fmm) {
-            return make_array<double>(
-                {fmm.u2e_ops.size()}, reinterpret_cast<double*>(fmm.u2e_ops.data())
-            );
-        })
-        .def_property_readonly("d2e_ops", [] (FMMMat<dim>& fmm) {
-            return make_array<double>(
-                {fmm.d2e_ops.size()}, reinterpret_cast<double*>(fmm.d2e_ops.data())
-            );
-        })
-        .def_property_readonly("tensor_dim", &FMMMat<dim>::tensor_dim)
-        .OP(p2m).OP(m2m).OP(p2l).OP(m2l).OP(l2l).OP(p2p).OP(m2p).OP(l2p).OP(u2e).OP(d2e)
-        .EVALFNC(p2p).EVALFNC(p2m).EVALFNC(p2l).EVALFNC(m2l).EVALFNC(m2p).EVALFNC(l2p)
-        .EVALFNCLEVEL(m2m).EVALFNCLEVEL(u2e).EVALFNCLEVEL(l2l).EVALFNCLEVEL(d2e);
+    wrap_fmm_mat<Octree<dim>>(m, "FMMMat");
+    wrap_fmm_mat<KDTree<dim>>(m, "KDFMMMat");
 
-#undef EXPOSEOP
-#undef EVALFNC
-#undef EVALFNCLEVEL
-
-    m.def("fmmmmmmm", &fmmmmmmm<dim>);
+    m.def("fmmmmmmm", [] (std::shared_ptr<Octree<dim>> obs_tree,
+        std::shared_ptr<Octree<dim>> src_tree, const FMMConfig<dim>& cfg)
+    {
+        return fmmmmmmm<Octree<dim>>(obs_tree, src_tree, cfg);
+    });
+    m.def("fmmmmmmm", [] (std::shared_ptr<KDTree<dim>> obs_tree,
+        std::shared_ptr<KDTree<dim>> src_tree, const FMMConfig<dim>& cfg)
+    {
+        return fmmmmmmm<KDTree<dim>>(obs_tree, src_tree, cfg);
+    });
 
     <%
     direct_eval_data = [
-        ("",["","n_obs_dofs * n_src_dofs",""]),
-        ("mf_",[",NPArrayD input","n_obs_dofs",", as_ptr<double>(input)"])
+        ("",["","n_obs_dofs * n_src_dofs","","K.tensor_dim * n_src_dofs"]),
+        ("mf_",[",NPArrayD input","n_obs_dofs",", as_ptr<double>(input)","K.tensor_dim"])
     ]
     %>
     % for name, extra in direct_eval_data:
@@ -147,11 +349,23 @@ void wrap_dim(py::module& m) {
             int n_src_dofs = K.tensor_dim * src_pts.request().shape[0];
             (void)n_src_dofs;
             std::vector<double> out(${extra[1]});
-            K.${name}f({as_ptr<std::array<double,dim>>(obs_pts), as_ptr<std::array<double,dim>>(obs_ns),
-               as_ptr<std::array<double,dim>>(src_pts), as_ptr<std::array<double,dim>>(src_ns),
-               obs_pts.request().shape[0], src_pts.request().shape[0],
-               as_ptr<double>(params)},
-              out.data()${extra[2]});
+            SoAPts<dim> soa_obs_pts(as_ptr<std::array<double,dim>>(obs_pts), obs_pts.request().shape[0]);
+            SoAPts<dim> soa_obs_ns(as_ptr<std::array<double,dim>>(obs_ns), obs_ns.request().shape[0]);
+            SoAPts<dim> soa_src_pts(as_ptr<std::array<double,dim>>(src_pts), src_pts.request().shape[0]);
+            SoAPts<dim> soa_src_ns(as_ptr<std::array<double,dim>>(src_ns), src_ns.request().shape[0]);
+            size_t n_obs = obs_pts.request().shape[0];
+            size_t n_src = src_pts.request().shape[0];
+            auto* params_ptr = as_ptr<double>(params);
+            // The kernels run serially, so blocks of obs points are evaluated
+            // in parallel.
+            const size_t block_size = 256;
+#pragma omp parallel for schedule(dynamic)
+            for (size_t start = 0; start < n_obs; start += block_size) {
+                K.${name}f({soa_obs_pts.view(start), soa_obs_ns.view(start),
+                   soa_src_pts.view(), soa_src_ns.view(),
+                   std::min(block_size, n_obs - start), n_src, params_ptr},
+                  out.data() + start * ${extra[3]}${extra[2]});
+            }
             return array_from_vector(out);
         });
     % endfor
@@ -178,9 +392,18 @@ PYBIND11_PLUGIN(fmm) {
         return make_array({op.name.size()}, op.name.data());\
     })
 
+    py::class_<PruneCounts>(m, "PruneCounts")
+        .def_readonly("p2m", &PruneCounts::p2m)
+        .def_readonly("m2m", &PruneCounts::m2m)
+        .def_readonly("u2e", &PruneCounts::u2e)
+        .def_readonly("l2l", &PruneCounts::l2l)
+        .def_readonly("d2e", &PruneCounts::d2e)
+        .def_readonly("l2p", &PruneCounts::l2p);
+
     py::class_<MatrixFreeOp>(m, "MatrixFreeOp")
         .NPARRAYPROP(obs_n_start).NPARRAYPROP(obs_n_end).NPARRAYPROP(obs_n_idx)
-        .NPARRAYPROP(src_n_start).NPARRAYPROP(src_n_end).NPARRAYPROP(src_n_idx);
+        .NPARRAYPROP(src_n_start).NPARRAYPROP(src_n_end).NPARRAYPROP(src_n_idx)
+        .NPARRAYPROP(group_starts);
 #undef NPARRAYPROP
 
     return m.ptr();
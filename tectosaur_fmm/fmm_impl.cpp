@@ -1,13 +1,21 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <numeric>
+#include <omp.h>
+#include <stdexcept>
 
 #include "include/timing.hpp"
 #include "fmm_impl.hpp"
+#include "fft.hpp"
 
-template <size_t dim>
-void traverse(FMMMat<dim>& mat, const OctreeNode<dim>& obs_n, const OctreeNode<dim>& src_n) {
+template <typename TreeT>
+bool well_separated(const FMMMat<TreeT>& mat, const typename TreeT::Node& obs_n,
+    const typename TreeT::Node& src_n)
+{
     auto r_src = src_n.bounds.R();
     auto r_obs = obs_n.bounds.R();
     auto sep = hypot(sub(obs_n.bounds.center, src_n.bounds.center));
@@ -18,72 +26,392 @@ void traverse(FMMMat<dim>& mat, const OctreeNode<dim>& obs_n, const OctreeNode<d
     // That means it should be safe to perform approximate interactions. I add
     // a small safety factor just in case!
     double safety_factor = 0.98;
-    if (mat.cfg.outer_r * r_src + mat.cfg.inner_r * r_obs < safety_factor * sep) {
-        // If there aren't enough src or obs to justify using the approximation,
-        // then just do a p2p direct calculation between the nodes.
-        bool small_src = src_n.end - src_n.start < mat.surf.size();
-        bool small_obs = obs_n.end - obs_n.start < mat.surf.size();
-
-        if (small_src && small_obs) {
-            mat.p2p.insert(obs_n, src_n);
-        } else if (small_obs) {
-            mat.m2p.insert(obs_n, src_n);
-        } else if (small_src) {
-            mat.p2l.insert(obs_n, src_n);
-        } else {
-            mat.m2l.insert(obs_n, src_n);
-        }
+    return mat.cfg.outer_r * r_src + mat.cfg.inner_r * r_obs < safety_factor * sep;
+}
+
+// The node pairs found by traversing the trees, or some part of them. The
+// traversal only inserts pairs, so the same code can count the pairs or write
+// them at known positions instead of appending.
+enum InteractionType { P2P, M2P, P2L, M2L, N_INTERACTION_TYPES };
+
+template <typename T>
+using Interactions = std::array<T,N_INTERACTION_TYPES>;
 
+struct PairCount {
+    size_t n = 0;
+
+    template <typename NodeT>
+    void insert(const NodeT&, const NodeT&) { n++; }
+};
+
+struct PairWriter {
+    MatrixFreeOp* op;
+    size_t next;
+
+    template <typename NodeT>
+    void insert(const NodeT& obs_n, const NodeT& src_n) {
+        op->set(next, obs_n, src_n);
+        next++;
+    }
+};
+
+template <typename TreeT, typename T>
+void insert_far_field(const FMMMat<TreeT>& mat, Interactions<T>& out,
+    const typename TreeT::Node& obs_n, const typename TreeT::Node& src_n)
+{
+    // If there aren't enough src or obs to justify using the approximation,
+    // then just do a p2p direct calculation between the nodes.
+    bool small_src = src_n.end - src_n.start < mat.surf.size();
+    bool small_obs = obs_n.end - obs_n.start < mat.surf.size();
+
+    if (small_src && small_obs) {
+        out[P2P].insert(obs_n, src_n);
+    } else if (small_obs) {
+        out[M2P].insert(obs_n, src_n);
+    } else if (small_src) {
+        out[P2L].insert(obs_n, src_n);
+    } else {
+        out[M2L].insert(obs_n, src_n);
+    }
+}
+
+template <typename TreeT>
+void store_interactions(FMMMat<TreeT>& mat, Interactions<MatrixFreeOp>&& lists) {
+    mat.p2p = std::move(lists[P2P]);
+    mat.m2p = std::move(lists[M2P]);
+    mat.p2l = std::move(lists[P2L]);
+    mat.m2l = std::move(lists[M2L]);
+}
+
+// Node pairs that a depth limited traversal left for later. Each pair closes
+// the segment of interactions found before it, so placing the segments and
+// the traversals of the pairs in order gives the same lists as a full serial
+// traversal.
+template <typename T>
+struct DeferredPairs {
+    int max_depth;
+    std::vector<std::pair<size_t,size_t>> pairs;
+    std::vector<Interactions<T>> segments;
+};
+
+template <typename TreeT, typename T>
+void traverse(const FMMMat<TreeT>& mat, Interactions<T>& out,
+    const typename TreeT::Node& obs_n, const typename TreeT::Node& src_n,
+    DeferredPairs<T>* deferred = nullptr, int depth = 0)
+{
+    if (well_separated(mat, obs_n, src_n)) {
+        insert_far_field(mat, out, obs_n, src_n);
         return;
     }
 
     if (src_n.is_leaf && obs_n.is_leaf) {
-        mat.p2p.insert(obs_n, src_n);
+        out[P2P].insert(obs_n, src_n);
+        return;
+    }
+
+    if (deferred != nullptr && depth == deferred->max_depth) {
+        deferred->pairs.push_back({obs_n.idx, src_n.idx});
+        deferred->segments.push_back(std::move(out));
+        out = Interactions<T>();
         return;
     }
 
+    auto r_src = src_n.bounds.R();
+    auto r_obs = obs_n.bounds.R();
     bool split_src = ((r_obs < r_src) && !src_n.is_leaf) || obs_n.is_leaf;
     if (split_src) {
-        for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
-            traverse(mat, obs_n, mat.src_tree.nodes[src_n.children[i]]);
+        for (auto child_idx: src_n.children()) {
+            traverse(mat, out, obs_n, mat.src_tree->nodes[child_idx], deferred, depth + 1);
         }
     } else {
-        for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
-            traverse(mat, mat.obs_tree.nodes[obs_n.children[i]], src_n);
+        for (auto child_idx: obs_n.children()) {
+            traverse(mat, out, mat.obs_tree->nodes[child_idx], src_n, deferred, depth + 1);
         }
     }
 }
 
-template <size_t dim>
-void up_collect(FMMMat<dim>& mat, const OctreeNode<dim>& src_n) {
-    mat.u2e[src_n.height].insert(src_n, src_n);
-    if (src_n.is_leaf) {
-        mat.p2m.insert(src_n, src_n);
-    } else {
-        for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
-            auto child_n = mat.src_tree.nodes[src_n.children[i]];
-            up_collect(mat, child_n);
-            mat.m2m[src_n.height].insert(src_n, child_n);
+const std::array<std::vector<int> MatrixFreeOp::*,6> op_fields{{
+    &MatrixFreeOp::obs_n_start, &MatrixFreeOp::obs_n_end, &MatrixFreeOp::obs_n_idx,
+    &MatrixFreeOp::src_n_start, &MatrixFreeOp::src_n_end, &MatrixFreeOp::src_n_idx
+}};
+
+void copy_op(MatrixFreeOp& dest, size_t start, const MatrixFreeOp& src) {
+    for (auto field: op_fields) {
+        std::copy((src.*field).begin(), (src.*field).end(), (dest.*field).begin() + start);
+    }
+}
+
+// The top of the traversal runs serially, deeper each time, until it leaves
+// enough node pairs to keep every thread busy. Those pairs are traversed in
+// parallel twice: first to count their interactions and then to write them
+// straight into their place in the final lists. The result does not depend on
+// the number of threads.
+template <typename TreeT>
+void traverse(FMMMat<TreeT>& mat) {
+    auto& obs_root = mat.obs_tree->root();
+    auto& src_root = mat.src_tree->root();
+    size_t min_pairs = 16 * omp_get_max_threads();
+
+    Interactions<MatrixFreeOp> out;
+    DeferredPairs<MatrixFreeOp> deferred;
+    deferred.max_depth = 0;
+    do {
+        deferred.max_depth++;
+        deferred.pairs.clear();
+        deferred.segments.clear();
+        out = Interactions<MatrixFreeOp>();
+        traverse(mat, out, obs_root, src_root, &deferred);
+    } while (deferred.pairs.size() > 0 && deferred.pairs.size() < min_pairs);
+    deferred.segments.push_back(std::move(out));
+
+    size_t n_pairs = deferred.pairs.size();
+    std::vector<Interactions<PairCount>> counts(n_pairs);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < n_pairs; i++) {
+        auto& obs_n = mat.obs_tree->nodes[deferred.pairs[i].first];
+        auto& src_n = mat.src_tree->nodes[deferred.pairs[i].second];
+        traverse(mat, counts[i], obs_n, src_n);
+    }
+
+    Interactions<MatrixFreeOp> all;
+    std::vector<Interactions<PairWriter>> writers(n_pairs);
+    for (int k = 0; k < N_INTERACTION_TYPES; k++) {
+        size_t n = 0;
+        for (size_t i = 0; i < n_pairs; i++) {
+            n += deferred.segments[i][k].size() + counts[i][k].n;
         }
+        all[k].resize(n + deferred.segments[n_pairs][k].size());
+
+        size_t next = 0;
+        for (size_t i = 0; i <= n_pairs; i++) {
+            copy_op(all[k], next, deferred.segments[i][k]);
+            next += deferred.segments[i][k].size();
+            if (i < n_pairs) {
+                writers[i][k] = PairWriter{&all[k], next};
+                next += counts[i][k].n;
+            }
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < n_pairs; i++) {
+        auto& obs_n = mat.obs_tree->nodes[deferred.pairs[i].first];
+        auto& src_n = mat.src_tree->nodes[deferred.pairs[i].second];
+        traverse(mat, writers[i], obs_n, src_n);
     }
+    store_interactions(mat, std::move(all));
 }
 
-template <size_t dim>
-void down_collect(FMMMat<dim>& mat, const OctreeNode<dim>& obs_n) {
-    mat.d2e[obs_n.depth].insert(obs_n, obs_n);
-    if (obs_n.is_leaf) {
-        mat.l2p.insert(obs_n, obs_n);
-    } else {
-        for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
-            auto child_n = mat.obs_tree.nodes[obs_n.children[i]];
-            down_collect(mat, child_n);
-            mat.l2l[child_n.depth].insert(child_n, obs_n);
+// The operators gathered from each node by up_collect or down_collect.
+struct CollectedOps {
+    MatrixFreeOp pts;
+    std::vector<MatrixFreeOp> translation;
+    std::vector<MatrixFreeOp> check_to_equiv;
+
+    CollectedOps(size_t n_levels):
+        translation(n_levels),
+        check_to_equiv(n_levels)
+    {}
+
+    void append(const CollectedOps& other) {
+        pts.append(other.pts);
+        for (size_t i = 0; i < translation.size(); i++) {
+            translation[i].append(other.translation[i]);
+            check_to_equiv[i].append(other.check_to_equiv[i]);
+        }
+    }
+};
+
+// The nodes are split into fixed size chunks that are collected in parallel
+// and appended in order. The nodes are stored level by level, so this leaves
+// each level's operators sorted by node index.
+template <typename TreeT, typename F>
+CollectedOps collect(const TreeT& tree, const F& f) {
+    const size_t chunk_size = 1024;
+    size_t n_levels = tree.max_height + 1;
+    size_t n_chunks = (tree.nodes.size() + chunk_size - 1) / chunk_size;
+    std::vector<CollectedOps> chunks(n_chunks, CollectedOps(n_levels));
+#pragma omp parallel for
+    for (size_t i = 0; i < n_chunks; i++) {
+        size_t end = std::min(tree.nodes.size(), (i + 1) * chunk_size);
+        for (size_t j = i * chunk_size; j < end; j++) {
+            f(tree.nodes[j], chunks[i]);
         }
     }
+
+    CollectedOps out(n_levels);
+    for (auto& c: chunks) {
+        out.append(c);
+    }
+    return out;
 }
 
-template <size_t dim>
-FMMMat<dim>::FMMMat(Octree<dim> obs_tree, Octree<dim> src_tree, FMMConfig<dim> cfg,
+template <typename TreeT>
+void up_collect(FMMMat<TreeT>& mat) {
+    auto& src_tree = *mat.src_tree;
+    auto ops = collect(src_tree, [&] (const typename TreeT::Node& src_n, CollectedOps& out) {
+        out.check_to_equiv[src_n.height].insert(src_n, src_n);
+        if (src_n.is_leaf) {
+            out.pts.insert(src_n, src_n);
+        }
+        for (auto child_idx: src_n.children()) {
+            out.translation[src_n.height].insert(src_n, src_tree.nodes[child_idx]);
+        }
+    });
+    mat.p2m = std::move(ops.pts);
+    mat.m2m = std::move(ops.translation);
+    mat.u2e = std::move(ops.check_to_equiv);
+}
+
+template <typename TreeT>
+void down_collect(FMMMat<TreeT>& mat) {
+    auto& obs_tree = *mat.obs_tree;
+    auto ops = collect(obs_tree, [&] (const typename TreeT::Node& obs_n, CollectedOps& out) {
+        out.check_to_equiv[obs_n.depth].insert(obs_n, obs_n);
+        if (obs_n.is_leaf) {
+            out.pts.insert(obs_n, obs_n);
+        }
+        for (auto child_idx: obs_n.children()) {
+            auto& child_n = obs_tree.nodes[child_idx];
+            out.translation[child_n.depth].insert(child_n, obs_n);
+        }
+    });
+    mat.l2p = std::move(ops.pts);
+    mat.l2l = std::move(ops.translation);
+    mat.d2e = std::move(ops.check_to_equiv);
+}
+
+// Drops the entries whose node, taken from node_idx, is not used. Returns the
+// number of entries dropped.
+size_t remove_unused(MatrixFreeOp& op, std::vector<int> MatrixFreeOp::* node_idx,
+    const std::vector<bool>& used)
+{
+    size_t n_kept = 0;
+    for (size_t i = 0; i < op.size(); i++) {
+        if (!used[(op.*node_idx)[i]]) {
+            continue;
+        }
+        for (auto field: op_fields) {
+            (op.*field)[n_kept] = (op.*field)[i];
+        }
+        n_kept++;
+    }
+    size_t n_removed = op.size() - n_kept;
+    op.resize(n_kept);
+    return n_removed;
+}
+
+// A node's multipole is used if m2l or m2p read it or if its parent's
+// multipole is used, since m2m builds the parent from its children. A node
+// has a local if m2l or p2l write to it or if its parent has a local. The
+// upward and downward pass entries for the other nodes only compute zeros or
+// values that are never read.
+template <typename TreeT>
+void prune(FMMMat<TreeT>& mat) {
+    auto& src_nodes = mat.src_tree->nodes;
+    std::vector<bool> mp_used(src_nodes.size(), false);
+    for (auto* op: {&mat.m2l, &mat.m2p}) {
+        for (auto src_idx: op->src_n_idx) {
+            mp_used[src_idx] = true;
+        }
+    }
+
+    auto& obs_nodes = mat.obs_tree->nodes;
+    std::vector<bool> has_local(obs_nodes.size(), false);
+    for (auto* op: {&mat.m2l, &mat.p2l}) {
+        for (auto obs_idx: op->obs_n_idx) {
+            has_local[obs_idx] = true;
+        }
+    }
+
+    // Parents are stored before their children.
+    for (auto& n: src_nodes) {
+        for (auto child_idx: n.children()) {
+            mp_used[child_idx] = mp_used[child_idx] || mp_used[n.idx];
+        }
+    }
+    for (auto& n: obs_nodes) {
+        for (auto child_idx: n.children()) {
+            has_local[child_idx] = has_local[child_idx] || has_local[n.idx];
+        }
+    }
+
+    mat.pruned = PruneCounts();
+    mat.pruned.p2m = remove_unused(mat.p2m, &MatrixFreeOp::src_n_idx, mp_used);
+    mat.pruned.l2p = remove_unused(mat.l2p, &MatrixFreeOp::obs_n_idx, has_local);
+    for (size_t level = 0; level < mat.m2m.size(); level++) {
+        mat.pruned.m2m += remove_unused(mat.m2m[level], &MatrixFreeOp::obs_n_idx, mp_used);
+        mat.pruned.u2e += remove_unused(mat.u2e[level], &MatrixFreeOp::src_n_idx, mp_used);
+    }
+    for (size_t level = 0; level < mat.l2l.size(); level++) {
+        mat.pruned.l2l += remove_unused(mat.l2l[level], &MatrixFreeOp::src_n_idx, has_local);
+        mat.pruned.d2e += remove_unused(mat.d2e[level], &MatrixFreeOp::obs_n_idx, has_local);
+    }
+}
+
+// Sorts the entries of op into groups that write to separate outputs and
+// records where each group starts. Entries that write to their obs node's
+// values are grouped by obs node. Entries that write to the obs points are
+// grouped by overlapping point ranges, because the obs nodes of different
+// entries can be nested. The entries are counting sorted by obs node or by
+// first obs point, so each group keeps its entries in their original order
+// and the matvecs don't depend on the number of threads.
+void group_by_obs(MatrixFreeOp& op, bool writes_pts) {
+    auto& keys = writes_pts ? op.obs_n_start : op.obs_n_idx;
+    int n_keys = 0;
+    for (auto k: keys) {
+        n_keys = std::max(n_keys, k + 1);
+    }
+    std::vector<size_t> key_starts(n_keys + 1, 0);
+    for (auto k: keys) {
+        key_starts[k + 1]++;
+    }
+    std::partial_sum(key_starts.begin(), key_starts.end(), key_starts.begin());
+
+    MatrixFreeOp sorted;
+    sorted.resize(op.size());
+    for (size_t i = 0; i < op.size(); i++) {
+        size_t dest = key_starts[keys[i]]++;
+        for (auto field: op_fields) {
+            (sorted.*field)[dest] = (op.*field)[i];
+        }
+    }
+
+    int group_end = 0;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        bool new_group = i == 0 || (writes_pts ?
+            sorted.obs_n_start[i] >= group_end :
+            sorted.obs_n_idx[i] != sorted.obs_n_idx[i - 1]);
+        if (new_group) {
+            sorted.group_starts.push_back(i);
+            group_end = sorted.obs_n_end[i];
+        }
+        group_end = std::max(group_end, sorted.obs_n_end[i]);
+    }
+    sorted.group_starts.push_back(sorted.size());
+    op = std::move(sorted);
+}
+
+// Groups the entries of every list that the matvecs evaluate with the kernel.
+// This has to run after prune, which removes entries.
+template <typename TreeT>
+void group_by_obs(FMMMat<TreeT>& mat) {
+    for (auto* op: {&mat.p2p, &mat.m2p, &mat.l2p}) {
+        group_by_obs(*op, true);
+    }
+    for (auto* op: {&mat.p2m, &mat.p2l, &mat.m2l}) {
+        group_by_obs(*op, false);
+    }
+    for (auto* levels: {&mat.m2m, &mat.l2l}) {
+        for (auto& op: *levels) {
+            group_by_obs(op, false);
+        }
+    }
+}
+
+template <typename TreeT>
+FMMMat<TreeT>::FMMMat(std::shared_ptr<const TreeT> obs_tree,
+        std::shared_ptr<const TreeT> src_tree, FMMConfig<dim> cfg,
         std::vector<std::array<double,dim>> surf):
     obs_tree(obs_tree),
     src_tree(src_tree),
@@ -91,211 +419,771 @@ FMMMat<dim>::FMMMat(Octree<dim> obs_tree, Octree<dim> src_tree, FMMConfig<dim> c
     surf(surf)
 {}
 
-template <size_t dim>
-void interact_pts(const FMMConfig<dim>& cfg, double* out, double* in,
-    const std::array<double,dim>* obs_pts, const std::array<double,dim>* obs_ns,
+// KernelT is the type of cfg.kernel, from with_kernel.
+template <typename KernelT, size_t dim>
+void interact_pts(KernelT, const FMMConfig<dim>& cfg, double* out, double* in,
+    const std::array<const double*,dim>& obs_pts, const std::array<const double*,dim>& obs_ns,
     size_t n_obs, size_t obs_pt_start,
-    const std::array<double,dim>* src_pts, const std::array<double,dim>* src_ns,
+    const std::array<const double*,dim>& src_pts, const std::array<const double*,dim>& src_ns,
     size_t n_src, size_t src_pt_start) 
 {
     if (n_obs == 0 || n_src == 0) {
         return;
     }
 
-    double* out_val_start = &out[cfg.tensor_dim() * obs_pt_start];
-    double* in_val_start = &in[cfg.tensor_dim() * src_pt_start];
-    cfg.kernel.mf_f(
+    double* out_val_start = &out[KernelT::tensor_dim * obs_pt_start];
+    double* in_val_start = &in[KernelT::tensor_dim * src_pt_start];
+    KernelT::mf_f(
         NBodyProblem<dim>{obs_pts, obs_ns, src_pts, src_ns, n_obs, n_src, cfg.params.data()},
         out_val_start, in_val_start
     );
 }
 
+// Calls f(begin, end) on pieces covering [0, n) in parallel. Inside eval's
+// task graph the pieces are tasks, so threads that are done with, or waiting
+// on, another pass pick them up. Elsewhere they are a parallel loop.
+template <typename F>
+void parallel_range(size_t n, const F& f) {
+    if (n == 0) {
+        return;
+    }
+    if (!omp_in_parallel()) {
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < n; i++) {
+            f(i, i + 1);
+        }
+        return;
+    }
+    size_t n_tasks = std::min(n, 16 * static_cast<size_t>(omp_get_num_threads()));
+#pragma omp taskloop num_tasks(n_tasks)
+    for (size_t t = 0; t < n_tasks; t++) {
+        f(t * n / n_tasks, (t + 1) * n / n_tasks);
+    }
+}
 
-template <size_t dim>
-void FMMMat<dim>::p2m_matvec(double* out, double *in) {
-    for (size_t i = 0; i < p2m.obs_n_idx.size(); i++) {
-        auto src_n = src_tree.nodes[p2m.src_n_idx[i]];
-        auto check = inscribe_surf(src_n.bounds, cfg.outer_r, surf);
+// Calls f(begin, end) for the entries of each group of op, in parallel over
+// the groups. The kernels run serially inside f, so there is one level of
+// parallelism for the whole matvec.
+template <typename F>
+void for_each_obs_group(const MatrixFreeOp& op, const F& f) {
+    assert(op.size() == 0 || op.group_starts.size() > 0);
+    size_t n_groups = op.group_starts.empty() ? 0 : op.group_starts.size() - 1;
+    parallel_range(n_groups, [&] (size_t first, size_t last) {
+        for (size_t g = first; g < last; g++) {
+            f(op.group_starts[g], op.group_starts[g + 1]);
+        }
+    });
+}
+
+template <typename F>
+void for_each_by_obs(const MatrixFreeOp& op, const F& f) {
+    for_each_obs_group(op, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            f(i);
+        }
+    });
+}
+
+// The end of the run of entries starting at i that have the same obs node
+// and sources in consecutive point ranges. The run is one block of sources.
+size_t src_pts_run_end(const MatrixFreeOp& op, size_t i, size_t end) {
+    size_t run_end = i + 1;
+    while (run_end < end && op.obs_n_idx[run_end] == op.obs_n_idx[i] &&
+            op.src_n_start[run_end] == op.src_n_end[run_end - 1]) {
+        run_end++;
+    }
+    return run_end;
+}
+
+
+// The *_pass functions are the matvecs for the kernel type KernelT of
+// cfg.kernel. The *_matvec members pick the type with with_kernel on every
+// call, while eval picks it once for the whole evaluation.
+template <typename KernelT, typename TreeT>
+void p2m_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& surf = mat.surf;
+    for_each_by_obs(mat.p2m, [&] (size_t i) {
+        auto src_n = mat.src_tree->nodes[mat.p2m.src_n_idx[i]];
+        auto check = inscribe_surf_soa(src_n.bounds, mat.cfg.outer_r, surf);
         interact_pts(
-            cfg, out, in,
-            check.data(), surf.data(), 
+            k, mat.cfg, out, in,
+            check.view(), surf.view(), 
             surf.size(), src_n.idx * surf.size(),
-            &src_tree.pts[src_n.start], &src_tree.normals[src_n.start],
+            mat.src_tree->pts.view(src_n.start), mat.src_tree->normals.view(src_n.start),
             src_n.end - src_n.start, src_n.start
         );
-    }
+    });
 }
 
-template <size_t dim>
-void FMMMat<dim>::m2m_matvec(double* out, double *in, int level) {
-    for (size_t i = 0; i < m2m[level].obs_n_idx.size(); i++) {
-        auto parent_n = src_tree.nodes[m2m[level].obs_n_idx[i]];
-        auto child_n = src_tree.nodes[m2m[level].src_n_idx[i]];
-        auto check = inscribe_surf(parent_n.bounds, cfg.outer_r, surf);
-        auto equiv = inscribe_surf(child_n.bounds, cfg.inner_r, surf);
-        interact_pts(
-            cfg, out, in,
-            check.data(), surf.data(), 
-            surf.size(), parent_n.idx * surf.size(),
-            equiv.data(), surf.data(), 
-            surf.size(), child_n.idx * surf.size()
+template <typename TreeT>
+void FMMMat<TreeT>::p2m_matvec(double* out, double *in) {
+    with_kernel(cfg.kernel, [&] (auto k) { p2m_pass(k, *this, out, in); });
+}
+
+// Applies each dense operator to the entries of op in its group with one
+// matrix product: the inputs are gathered into rows, multiplied and added to
+// the outputs.
+void apply_dense_ops(const MatrixFreeOp& op, const std::vector<std::vector<size_t>>& groups,
+    const std::vector<std::vector<double>>& dense_ops, int n_rows, double* out, double* in)
+{
+    for (size_t g = 0; g < groups.size(); g++) {
+        auto& entries = groups[g];
+        if (entries.size() == 0) {
+            continue;
+        }
+        std::vector<double> in_rows(entries.size() * n_rows);
+        for (size_t i = 0; i < entries.size(); i++) {
+            auto* start = &in[op.src_n_idx[entries[i]] * n_rows];
+            std::copy(start, start + n_rows, &in_rows[i * n_rows]);
+        }
+        std::vector<double> out_rows(entries.size() * n_rows, 0.0);
+        batch_matrix_vector_product(
+            const_cast<double*>(dense_ops[g].data()), n_rows, n_rows,
+            in_rows.data(), entries.size(), out_rows.data()
         );
+        for (size_t i = 0; i < entries.size(); i++) {
+            auto* start = &out[op.obs_n_idx[entries[i]] * n_rows];
+            for (int j = 0; j < n_rows; j++) {
+                start[j] += out_rows[i * n_rows + j];
+            }
+        }
     }
 }
 
-template <size_t dim>
-void FMMMat<dim>::p2l_matvec(double* out, double* in) {
-    for (size_t i = 0; i < p2l.obs_n_idx.size(); i++) {
-        auto obs_n = obs_tree.nodes[p2l.obs_n_idx[i]];
-        auto src_n = src_tree.nodes[p2l.src_n_idx[i]];
+// The u2e or d2e entries of one level are sorted by node, and the nodes are
+// stored level by level, so runs of consecutive nodes with the same bounds
+// level are contiguous in both in and out. Each run is one matrix product
+// without any copies.
+template <typename TreeT>
+void check_to_equiv_matvec(const FMMMat<TreeT>& mat, const TreeT& tree,
+    const MatrixFreeOp& op, const std::vector<DenseOp>& ops,
+    const std::vector<double>& scales, int n_rows, double* out, double* in)
+{
+    std::vector<double> projected;
+    size_t i = 0;
+    while (i < op.size()) {
+        int first = op.obs_n_idx[i];
+        int bounds_level = tree.nodes[first].bounds_level;
+        size_t end = i + 1;
+        while (end < op.size() && op.obs_n_idx[end] == first + int(end - i) &&
+                tree.nodes[op.obs_n_idx[end]].bounds_level == bounds_level) {
+            end++;
+        }
+        auto& c2e = ops[mat.c2e_op_idx(bounds_level)];
+        auto* c2e_ptr = const_cast<double*>(c2e.data());
+        int rank = mat.c2e_rank(c2e);
+        if (rank < n_rows) {
+            projected.assign((end - i) * rank, 0.0);
+            batch_matrix_vector_product(
+                c2e_ptr + n_rows * rank, rank, n_rows,
+                &in[first * n_rows], end - i, projected.data()
+            );
+            batch_matrix_vector_product(
+                c2e_ptr, n_rows, rank, projected.data(), end - i,
+                &out[first * n_rows], scales[bounds_level]
+            );
+        } else {
+            batch_matrix_vector_product(
+                c2e_ptr, n_rows, n_rows, &in[first * n_rows], end - i,
+                &out[first * n_rows], scales[bounds_level]
+            );
+        }
+        i = end;
+    }
+}
 
-        auto check = inscribe_surf(obs_n.bounds, cfg.inner_r, surf);
-        interact_pts(
-            cfg, out, in,
-            check.data(), surf.data(), 
-            surf.size(), obs_n.idx * surf.size(),
-            &src_tree.pts[src_n.start], &src_tree.normals[src_n.start],
-            src_n.end - src_n.start, src_n.start
-        );
+// The index of the dense operator for translating between a parent and a
+// child, or -1 if the child is not exactly one of its parent's octants.
+template <typename TreeT>
+int translation_op_idx(const TreeT& tree, const typename TreeT::Node& parent_n,
+    const typename TreeT::Node& child_n)
+{
+    int octant = child_octant(parent_n.bounds, child_n.bounds);
+    if (octant < 0 || parent_n.bounds_level >= tree.max_height) {
+        return -1;
     }
+    return (parent_n.bounds_level << TreeT::spatial_dim) + octant;
 }
 
-template <size_t dim>
-void FMMMat<dim>::m2l_matvec(double* out, double* in) {
-    for (size_t i = 0; i < m2l.obs_n_idx.size(); i++) {
-        auto obs_n = obs_tree.nodes[m2l.obs_n_idx[i]];
-        auto src_n = src_tree.nodes[m2l.src_n_idx[i]];
+// Entries with a dense operator are grouped by operator and multiplied all at
+// once. The other entries, from a KDTree or adaptive bounds, evaluate the
+// kernel between the surfaces.
+template <typename KernelT, typename TreeT>
+void translate_pass(KernelT k, const FMMMat<TreeT>& mat, const TreeT& tree,
+    const MatrixFreeOp& op, const std::vector<std::vector<double>>& dense_ops,
+    bool parent_is_obs, double obs_r, double src_r, double* out, double* in)
+{
+    auto& surf = mat.surf;
+    int n_rows = mat.tensor_dim() * surf.size();
+
+    std::vector<int> op_idxs(op.size());
+    std::vector<std::vector<size_t>> groups(dense_ops.size());
+    for (size_t i = 0; i < op.size(); i++) {
+        auto& obs_n = tree.nodes[op.obs_n_idx[i]];
+        auto& src_n = tree.nodes[op.src_n_idx[i]];
+        op_idxs[i] = parent_is_obs ?
+            translation_op_idx(tree, obs_n, src_n) :
+            translation_op_idx(tree, src_n, obs_n);
+        if (op_idxs[i] >= 0) {
+            groups[op_idxs[i]].push_back(i);
+        }
+    }
 
-        auto check = inscribe_surf(obs_n.bounds, cfg.inner_r, surf);
-        auto equiv = inscribe_surf(src_n.bounds, cfg.inner_r, surf);
+    for_each_by_obs(op, [&] (size_t i) {
+        if (op_idxs[i] >= 0) {
+            return;
+        }
+        auto& obs_n = tree.nodes[op.obs_n_idx[i]];
+        auto& src_n = tree.nodes[op.src_n_idx[i]];
+        auto check = inscribe_surf_soa(obs_n.bounds, obs_r, surf);
+        auto equiv = inscribe_surf_soa(src_n.bounds, src_r, surf);
         interact_pts(
-            cfg, out, in,
-            check.data(), surf.data(), 
+            k, mat.cfg, out, in,
+            check.view(), surf.view(),
             surf.size(), obs_n.idx * surf.size(),
-            equiv.data(), surf.data(), 
+            equiv.view(), surf.view(),
             surf.size(), src_n.idx * surf.size()
         );
+    });
+
+    apply_dense_ops(op, groups, dense_ops, n_rows, out, in);
+}
+
+template <typename KernelT, typename TreeT>
+void m2m_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in, int level) {
+    translate_pass(
+        k, mat, *mat.src_tree, mat.m2m[level], mat.m2m_ops, true,
+        mat.cfg.outer_r, mat.cfg.inner_r, out, in
+    );
+}
+
+template <typename TreeT>
+void FMMMat<TreeT>::m2m_matvec(double* out, double *in, int level) {
+    with_kernel(cfg.kernel, [&] (auto k) { m2m_pass(k, *this, out, in, level); });
+}
+
+template <typename KernelT, typename TreeT>
+void p2l_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& surf = mat.surf;
+    auto& p2l = mat.p2l;
+    for_each_obs_group(p2l, [&] (size_t begin, size_t end) {
+        auto obs_n = mat.obs_tree->nodes[p2l.obs_n_idx[begin]];
+        auto check = inscribe_surf_soa(obs_n.bounds, mat.cfg.inner_r, surf);
+        for (size_t i = begin; i < end;) {
+            size_t run_end = src_pts_run_end(p2l, i, end);
+            size_t src_start = p2l.src_n_start[i];
+            interact_pts(
+                k, mat.cfg, out, in,
+                check.view(), surf.view(), 
+                surf.size(), obs_n.idx * surf.size(),
+                mat.src_tree->pts.view(src_start), mat.src_tree->normals.view(src_start),
+                p2l.src_n_end[run_end - 1] - src_start, src_start
+            );
+            i = run_end;
+        }
+    });
+}
+
+template <typename TreeT>
+void FMMMat<TreeT>::p2l_matvec(double* out, double* in) {
+    with_kernel(cfg.kernel, [&] (auto k) { p2l_pass(k, *this, out, in); });
+}
+
+// The FFT size for convolutions between surface grids with side points along
+// each edge: the smallest size with prime factors 2, 3 and 5 that holds the
+// 2 * side - 1 offsets between grid points without wrapping around.
+inline size_t fft_m2l_size(size_t side) {
+    size_t n = 2 * side - 1;
+    while (true) {
+        size_t rest = n;
+        for (size_t f: {2, 3, 5}) {
+            while (rest % f == 0) {
+                rest /= f;
+            }
+        }
+        if (rest == 1) {
+            return n;
+        }
+        n++;
     }
 }
 
+// The position of each surface point in the row-major FFT grid.
+template <typename TreeT>
+std::vector<size_t> surf_fft_idx(const FMMMat<TreeT>& mat, size_t side, size_t fft_n) {
+    const size_t dim = TreeT::spatial_dim;
+    double half_width = 1.0 / std::sqrt(static_cast<double>(dim));
+    std::vector<size_t> idx(mat.surf.size(), 0);
+    for (size_t i = 0; i < mat.surf.size(); i++) {
+        for (size_t d = 0; d < dim; d++) {
+            auto coord = std::lround(
+                (mat.surf.xs[d * mat.surf.size() + i] / half_width + 1.0) * (side - 1) / 2.0
+            );
+            idx[i] = idx[i] * fft_n + coord;
+        }
+    }
+    return idx;
+}
 
-template <size_t dim>
-void FMMMat<dim>::l2l_matvec(double* out, double* in, int level) {
-    for (size_t i = 0; i < l2l[level].obs_n_idx.size(); i++) {
-        auto child_n = obs_tree.nodes[l2l[level].obs_n_idx[i]];
-        auto parent_n = obs_tree.nodes[l2l[level].src_n_idx[i]];
+// Applies the m2l entries with an FFT operator level by level. The
+// multipoles of each src node are transformed once, the products with the
+// transformed kernels are summed for each obs node and the sums are
+// transformed back once per obs node.
+template <typename TreeT>
+void apply_fft_m2l(const FMMMat<TreeT>& mat, double* out, double* in) {
+    typedef std::complex<double> Complex;
+    const size_t dim = TreeT::spatial_dim;
+    auto& m2l = mat.m2l;
+    int td = mat.tensor_dim();
+    size_t n_surf = mat.surf.size();
+    size_t n_rows = td * n_surf;
+    size_t side = cube_surface_side<dim>(mat.cfg.order);
+    FFT fft(fft_m2l_size(side));
+    size_t n_grid = std::pow(fft.size(), dim);
+    auto grid_idx = surf_fft_idx(mat, side, fft.size());
 
-        auto check = inscribe_surf(child_n.bounds, cfg.inner_r, surf);
-        auto equiv = inscribe_surf(parent_n.bounds, cfg.outer_r, surf);
-        interact_pts(
-            cfg, out, in,
-            check.data(), surf.data(), 
-            surf.size(), child_n.idx * surf.size(),
-            equiv.data(), surf.data(), 
-            surf.size(), parent_n.idx * surf.size()
+    std::map<int,std::vector<size_t>> level_entries;
+    for (size_t i = 0; i < m2l.size(); i++) {
+        if (mat.m2l_fft_idx[i] >= 0) {
+            level_entries[mat.m2l_fft_keys[mat.m2l_fft_idx[i]][0]].push_back(i);
+        }
+    }
+
+    // The transformed multipoles of a level can take far more memory than the
+    // multipoles themselves, so the obs nodes of each level are taken in
+    // batches whose src nodes fit in cfg.fft_m2l_bytes. The obs nodes are
+    // in tree order, so neighboring obs nodes in a batch share most of their
+    // src nodes.
+    size_t src_bytes = td * n_grid * sizeof(Complex);
+    size_t max_src_nodes = std::max<size_t>(1, mat.cfg.fft_m2l_bytes / src_bytes);
+    std::vector<int> src_row(mat.src_tree->nodes.size(), -1);
+    for (auto& level: level_entries) {
+        std::map<int,std::vector<size_t>> obs_entries;
+        for (auto e: level.second) {
+            obs_entries[m2l.obs_n_idx[e]].push_back(e);
+        }
+        std::vector<std::pair<int,std::vector<size_t>>> obs_nodes(
+            obs_entries.begin(), obs_entries.end()
+        );
+
+        size_t batch_start = 0;
+        while (batch_start < obs_nodes.size()) {
+            std::vector<int> src_nodes;
+            size_t batch_end = batch_start;
+            while (batch_end < obs_nodes.size()) {
+                size_t n_before = src_nodes.size();
+                for (auto e: obs_nodes[batch_end].second) {
+                    if (src_row[m2l.src_n_idx[e]] < 0) {
+                        src_row[m2l.src_n_idx[e]] = src_nodes.size();
+                        src_nodes.push_back(m2l.src_n_idx[e]);
+                    }
+                }
+                if (src_nodes.size() > max_src_nodes && batch_end > batch_start) {
+                    for (size_t i = n_before; i < src_nodes.size(); i++) {
+                        src_row[src_nodes[i]] = -1;
+                    }
+                    src_nodes.resize(n_before);
+                    break;
+                }
+                batch_end++;
+            }
+
+            std::vector<Complex> src_hat(src_nodes.size() * td * n_grid);
+            parallel_range(src_nodes.size(), [&] (size_t first, size_t last) {
+                for (size_t i = first; i < last; i++) {
+                    for (int c = 0; c < td; c++) {
+                        auto* grid = &src_hat[(i * td + c) * n_grid];
+                        for (size_t j = 0; j < n_surf; j++) {
+                            grid[grid_idx[j]] = in[src_nodes[i] * n_rows + j * td + c];
+                        }
+                        fft.forward_grid(grid, dim);
+                    }
+                }
+            });
+
+            parallel_range(batch_end - batch_start, [&] (size_t first, size_t last) {
+                std::vector<Complex> sum(td * n_grid);
+                for (size_t i = batch_start + first; i < batch_start + last; i++) {
+                    std::fill(sum.begin(), sum.end(), 0.0);
+                    for (auto e: obs_nodes[i].second) {
+                        auto& op = mat.m2l_fft_ops[mat.m2l_fft_idx[e]];
+                        auto* src = &src_hat[src_row[m2l.src_n_idx[e]] * td * n_grid];
+                        for (int c1 = 0; c1 < td; c1++) {
+                            for (int c2 = 0; c2 < td; c2++) {
+                                auto* k = &op[(c1 * td + c2) * n_grid];
+                                auto* q = &src[c2 * n_grid];
+                                auto* s = &sum[c1 * n_grid];
+                                for (size_t g = 0; g < n_grid; g++) {
+                                    s[g] = FFT::mul_add(s[g], k[g], q[g]);
+                                }
+                            }
+                        }
+                    }
+                    auto* obs_out = &out[obs_nodes[i].first * n_rows];
+                    for (int c = 0; c < td; c++) {
+                        auto* grid = &sum[c * n_grid];
+                        fft.inverse_grid(grid, dim);
+                        for (size_t j = 0; j < n_surf; j++) {
+                            obs_out[j * td + c] += grid[grid_idx[j]].real() / n_grid;
+                        }
+                    }
+                }
+            });
+
+            for (auto n: src_nodes) {
+                src_row[n] = -1;
+            }
+            batch_start = batch_end;
+        }
+    }
+}
+
+// Applies the compressed m2l operators. For each basis, the multipoles of
+// the src nodes are projected once, the small operators act on the projected
+// multipoles and the results are expanded once per obs node.
+template <typename TreeT>
+void apply_svd_m2l(const FMMMat<TreeT>& mat, const std::vector<std::vector<size_t>>& groups,
+    double* out, double* in)
+{
+    auto& m2l = mat.m2l;
+    int n_rows = mat.tensor_dim() * mat.surf.size();
+    std::vector<std::vector<size_t>> basis_ops(mat.m2l_bases.size());
+    for (size_t i = 0; i < mat.m2l_svd_ops.size(); i++) {
+        basis_ops[mat.m2l_op_basis[i]].push_back(i);
+    }
+    std::vector<int> src_row(mat.src_tree->nodes.size(), -1);
+    std::vector<int> obs_row(mat.obs_tree->nodes.size(), -1);
+    for (size_t b = 0; b < mat.m2l_bases.size(); b++) {
+        auto& basis = mat.m2l_bases[b];
+        int rank = basis.rank;
+        std::vector<int> src_nodes;
+        std::vector<int> obs_nodes;
+        for (auto op_idx: basis_ops[b]) {
+            for (auto e: groups[op_idx]) {
+                if (src_row[m2l.src_n_idx[e]] < 0) {
+                    src_row[m2l.src_n_idx[e]] = src_nodes.size();
+                    src_nodes.push_back(m2l.src_n_idx[e]);
+                }
+                if (obs_row[m2l.obs_n_idx[e]] < 0) {
+                    obs_row[m2l.obs_n_idx[e]] = obs_nodes.size();
+                    obs_nodes.push_back(m2l.obs_n_idx[e]);
+                }
+            }
+        }
+        if (src_nodes.size() == 0) {
+            continue;
+        }
+
+        std::vector<double> in_rows(src_nodes.size() * n_rows);
+        for (size_t i = 0; i < src_nodes.size(); i++) {
+            auto* start = &in[src_nodes[i] * n_rows];
+            std::copy(start, start + n_rows, &in_rows[i * n_rows]);
+        }
+        std::vector<double> projected(src_nodes.size() * rank, 0.0);
+        batch_matrix_vector_product(
+            const_cast<double*>(basis.Vt.data()), rank, n_rows,
+            in_rows.data(), src_nodes.size(), projected.data()
         );
+
+        std::vector<double> translated(obs_nodes.size() * rank, 0.0);
+        for (auto op_idx: basis_ops[b]) {
+            auto& entries = groups[op_idx];
+            if (entries.size() == 0) {
+                continue;
+            }
+            std::vector<double> op_in(entries.size() * rank);
+            for (size_t i = 0; i < entries.size(); i++) {
+                auto* start = &projected[src_row[m2l.src_n_idx[entries[i]]] * rank];
+                std::copy(start, start + rank, &op_in[i * rank]);
+            }
+            std::vector<double> op_out(entries.size() * rank, 0.0);
+            batch_matrix_vector_product(
+                const_cast<double*>(mat.m2l_svd_ops[op_idx].data()), rank, rank,
+                op_in.data(), entries.size(), op_out.data()
+            );
+            for (size_t i = 0; i < entries.size(); i++) {
+                auto* start = &translated[obs_row[m2l.obs_n_idx[entries[i]]] * rank];
+                for (int j = 0; j < rank; j++) {
+                    start[j] += op_out[i * rank + j];
+                }
+            }
+        }
+
+        std::vector<double> out_rows(obs_nodes.size() * n_rows, 0.0);
+        batch_matrix_vector_product(
+            const_cast<double*>(basis.U.data()), n_rows, rank,
+            translated.data(), obs_nodes.size(), out_rows.data()
+        );
+        for (size_t i = 0; i < obs_nodes.size(); i++) {
+            auto* start = &out[obs_nodes[i] * n_rows];
+            for (int j = 0; j < n_rows; j++) {
+                start[j] += out_rows[i * n_rows + j];
+            }
+            obs_row[obs_nodes[i]] = -1;
+        }
+        for (auto n: src_nodes) {
+            src_row[n] = -1;
+        }
     }
 }
 
-template <size_t dim>
-void FMMMat<dim>::p2p_matvec(double* out, double* in) {
-    for (size_t i = 0; i < p2p.obs_n_idx.size(); i++) {
-        auto obs_n = obs_tree.nodes[p2p.obs_n_idx[i]];
-        auto src_n = src_tree.nodes[p2p.src_n_idx[i]];
+template <typename KernelT, typename TreeT>
+void m2l_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& surf = mat.surf;
+    auto& m2l = mat.m2l;
+    std::vector<std::vector<size_t>> groups(mat.m2l_ops.size());
+    for (size_t i = 0; i < m2l.size(); i++) {
+        if (mat.m2l_fft_idx[i] < 0 && mat.m2l_op_idx[i] >= 0) {
+            groups[mat.m2l_op_idx[i]].push_back(i);
+        }
+    }
+    for_each_by_obs(m2l, [&] (size_t i) {
+        if (mat.m2l_fft_idx[i] >= 0 || mat.m2l_op_idx[i] >= 0) {
+            return;
+        }
+        auto obs_n = mat.obs_tree->nodes[m2l.obs_n_idx[i]];
+        auto src_n = mat.src_tree->nodes[m2l.src_n_idx[i]];
+
+        auto check = inscribe_surf_soa(obs_n.bounds, mat.cfg.inner_r, surf);
+        auto equiv = inscribe_surf_soa(src_n.bounds, mat.cfg.inner_r, surf);
         interact_pts(
-            cfg, out, in,
-            &obs_tree.pts[obs_n.start], &obs_tree.normals[obs_n.start],
-            obs_n.end - obs_n.start, obs_n.start,
-            &src_tree.pts[src_n.start], &src_tree.normals[src_n.start],
-            src_n.end - src_n.start, src_n.start
+            k, mat.cfg, out, in,
+            check.view(), surf.view(), 
+            surf.size(), obs_n.idx * surf.size(),
+            equiv.view(), surf.view(), 
+            surf.size(), src_n.idx * surf.size()
         );
+    });
+    if (mat.m2l_bases.size() > 0) {
+        apply_svd_m2l(mat, groups, out, in);
+    } else {
+        apply_dense_ops(m2l, groups, mat.m2l_ops, mat.tensor_dim() * surf.size(), out, in);
+    }
+    if (mat.m2l_fft_ops.size() > 0) {
+        apply_fft_m2l(mat, out, in);
     }
 }
 
+template <typename TreeT>
+void FMMMat<TreeT>::m2l_matvec(double* out, double* in) {
+    with_kernel(cfg.kernel, [&] (auto k) { m2l_pass(k, *this, out, in); });
+}
 
-template <size_t dim>
-void FMMMat<dim>::m2p_matvec(double* out, double* in) {
-    for (size_t i = 0; i < m2p.obs_n_idx.size(); i++) {
-        auto obs_n = obs_tree.nodes[m2p.obs_n_idx[i]];
-        auto src_n = src_tree.nodes[m2p.src_n_idx[i]];
+template <typename KernelT, typename TreeT>
+void l2l_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in, int level) {
+    translate_pass(
+        k, mat, *mat.obs_tree, mat.l2l[level], mat.l2l_ops, false,
+        mat.cfg.inner_r, mat.cfg.outer_r, out, in
+    );
+}
+
+template <typename TreeT>
+void FMMMat<TreeT>::l2l_matvec(double* out, double* in, int level) {
+    with_kernel(cfg.kernel, [&] (auto k) { l2l_pass(k, *this, out, in, level); });
+}
 
-        auto equiv = inscribe_surf(src_n.bounds, cfg.inner_r, surf);
+template <typename KernelT, typename TreeT>
+void p2p_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& p2p = mat.p2p;
+    auto& obs_tree = *mat.obs_tree;
+    auto& src_tree = *mat.src_tree;
+    for_each_obs_group(p2p, [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end;) {
+            size_t run_end = src_pts_run_end(p2p, i, end);
+            auto obs_n = obs_tree.nodes[p2p.obs_n_idx[i]];
+            size_t src_start = p2p.src_n_start[i];
+            interact_pts(
+                k, mat.cfg, out, in,
+                obs_tree.pts.view(obs_n.start), obs_tree.normals.view(obs_n.start),
+                obs_n.end - obs_n.start, obs_n.start,
+                src_tree.pts.view(src_start), src_tree.normals.view(src_start),
+                p2p.src_n_end[run_end - 1] - src_start, src_start
+            );
+            i = run_end;
+        }
+    });
+}
+
+template <typename TreeT>
+void FMMMat<TreeT>::p2p_matvec(double* out, double* in) {
+    with_kernel(cfg.kernel, [&] (auto k) { p2p_pass(k, *this, out, in); });
+}
+
+template <typename KernelT, typename TreeT>
+void m2p_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& surf = mat.surf;
+    auto& obs_tree = *mat.obs_tree;
+    for_each_by_obs(mat.m2p, [&] (size_t i) {
+        auto obs_n = obs_tree.nodes[mat.m2p.obs_n_idx[i]];
+        auto src_n = mat.src_tree->nodes[mat.m2p.src_n_idx[i]];
+
+        auto equiv = inscribe_surf_soa(src_n.bounds, mat.cfg.inner_r, surf);
         interact_pts(
-            cfg, out, in,
-            &obs_tree.pts[obs_n.start], &obs_tree.normals[obs_n.start],
+            k, mat.cfg, out, in,
+            obs_tree.pts.view(obs_n.start), obs_tree.normals.view(obs_n.start),
             obs_n.end - obs_n.start, obs_n.start,
-            equiv.data(), surf.data(),
+            equiv.view(), surf.view(),
             surf.size(), src_n.idx * surf.size()
         );
-    }
+    });
 }
 
+template <typename TreeT>
+void FMMMat<TreeT>::m2p_matvec(double* out, double* in) {
+    with_kernel(cfg.kernel, [&] (auto k) { m2p_pass(k, *this, out, in); });
+}
 
-template <size_t dim>
-void FMMMat<dim>::l2p_matvec(double* out, double* in) {
-    for (size_t i = 0; i < l2p.obs_n_idx.size(); i++) {
-        auto obs_n = obs_tree.nodes[l2p.obs_n_idx[i]];
+template <typename KernelT, typename TreeT>
+void l2p_pass(KernelT k, const FMMMat<TreeT>& mat, double* out, double* in) {
+    auto& surf = mat.surf;
+    auto& obs_tree = *mat.obs_tree;
+    for_each_by_obs(mat.l2p, [&] (size_t i) {
+        auto obs_n = obs_tree.nodes[mat.l2p.obs_n_idx[i]];
 
-        auto equiv = inscribe_surf(obs_n.bounds, cfg.outer_r, surf);
+        auto equiv = inscribe_surf_soa(obs_n.bounds, mat.cfg.outer_r, surf);
         interact_pts(
-            cfg, out, in,
-            &obs_tree.pts[obs_n.start], &obs_tree.normals[obs_n.start],
+            k, mat.cfg, out, in,
+            obs_tree.pts.view(obs_n.start), obs_tree.normals.view(obs_n.start),
             obs_n.end - obs_n.start, obs_n.start,
-            equiv.data(), surf.data(),
+            equiv.view(), surf.view(),
             surf.size(), obs_n.idx * surf.size()
         );
-    }
+    });
 }
 
-template <size_t dim>
-void FMMMat<dim>::d2e_matvec(double* out, double* in, int level) {
+template <typename TreeT>
+void FMMMat<TreeT>::l2p_matvec(double* out, double* in) {
+    with_kernel(cfg.kernel, [&] (auto k) { l2p_pass(k, *this, out, in); });
+}
+
+template <typename TreeT>
+void FMMMat<TreeT>::d2e_matvec(double* out, double* in, int level) {
     int n_rows = cfg.tensor_dim() * surf.size();
-    for (size_t i = 0; i < d2e[level].obs_n_idx.size(); i++) {
-        auto node_idx = d2e[level].obs_n_idx[i];
-        auto depth = obs_tree.nodes[node_idx].depth;
-        double* op = &d2e_ops[depth * n_rows * n_rows];
-        matrix_vector_product(
-            op, n_rows, n_rows, 
-            &in[node_idx * n_rows],
-            &out[node_idx * n_rows]
-        );
-    }
+    check_to_equiv_matvec(*this, *obs_tree, d2e[level], d2e_ops, d2e_scales, n_rows, out, in);
 }
 
-template <size_t dim>
-void FMMMat<dim>::u2e_matvec(double* out, double* in, int level) {
+template <typename TreeT>
+void FMMMat<TreeT>::u2e_matvec(double* out, double* in, int level) {
     int n_rows = cfg.tensor_dim() * surf.size();
-    for (size_t i = 0; i < u2e[level].src_n_idx.size(); i++) {
-        auto node_idx = u2e[level].src_n_idx[i];
-        auto depth = src_tree.nodes[node_idx].depth;
-        double* op = &u2e_ops[depth * n_rows * n_rows];
-        matrix_vector_product(
-            op, n_rows, n_rows, 
-            &in[node_idx * n_rows],
-            &out[node_idx * n_rows]
-        );
+    check_to_equiv_matvec(*this, *src_tree, u2e[level], u2e_ops, u2e_scales, n_rows, out, in);
+}
+
+std::unique_ptr<EvalWorkspace> EvalWorkspacePool::take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free.empty()) {
+        return std::unique_ptr<EvalWorkspace>(new EvalWorkspace());
+    }
+    auto ws = std::move(free.back());
+    free.pop_back();
+    return ws;
+}
+
+void EvalWorkspacePool::give_back(std::unique_ptr<EvalWorkspace> ws) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free.push_back(std::move(ws));
+}
+
+// The passes run as a task graph. p2p and p2l only need the input, so they
+// start right away and fill the threads that the upward pass leaves idle at
+// the narrow top levels of the tree. The upward pass runs level by level on
+// the thread that builds the graph. The downward pass waits for p2l and
+// starts once the multipoles are done, alongside m2p. The far field values
+// from m2p and l2p are summed separately from p2p's and added at the end,
+// so the result doesn't depend on the order the tasks run in. The kernel
+// type is picked once here and the typed passes are called directly.
+template <typename TreeT>
+void FMMMat<TreeT>::eval(double* out, const double* in) {
+    std::shared_lock<std::shared_timed_mutex> lock(*state_mutex);
+    size_t n_rows = tensor_dim() * surf.size();
+    size_t n_out = tensor_dim() * obs_tree->n_pts;
+    auto ws = workspaces->take();
+    ws->m_check.assign(src_tree->nodes.size() * n_rows, 0.0);
+    ws->multipoles.assign(src_tree->nodes.size() * n_rows, 0.0);
+    ws->l_check.assign(obs_tree->nodes.size() * n_rows, 0.0);
+    ws->locals.assign(obs_tree->nodes.size() * n_rows, 0.0);
+    ws->far.assign(n_out, 0.0);
+    std::fill(out, out + n_out, 0.0);
+
+    // None of the matvecs write to their input.
+    auto* src_vals = const_cast<double*>(in);
+    double* m_check = ws->m_check.data();
+    double* multipoles = ws->multipoles.data();
+    double* l_check = ws->l_check.data();
+    double* locals = ws->locals.data();
+    double* far = ws->far.data();
+
+    with_kernel(cfg.kernel, [&] (auto k) {
+#pragma omp parallel
+#pragma omp single
+        {
+#pragma omp task
+            p2p_pass(k, *this, out, src_vals);
+
+#pragma omp task depend(out: l_check[0])
+            p2l_pass(k, *this, l_check, src_vals);
+
+            p2m_pass(k, *this, m_check, src_vals);
+            u2e_matvec(multipoles, m_check, 0);
+            for (size_t i = 1; i < m2m.size(); i++) {
+                m2m_pass(k, *this, m_check, multipoles, i);
+                u2e_matvec(multipoles, m_check, i);
+            }
+
+#pragma omp task depend(out: far[0])
+            m2p_pass(k, *this, far, multipoles);
+
+#pragma omp task depend(inout: l_check[0]) depend(out: locals[0])
+            {
+                m2l_pass(k, *this, l_check, multipoles);
+                d2e_matvec(locals, l_check, 0);
+                for (size_t i = 1; i < l2l.size(); i++) {
+                    l2l_pass(k, *this, l_check, locals, i);
+                    d2e_matvec(locals, l_check, i);
+                }
+            }
+
+#pragma omp task depend(in: locals[0]) depend(inout: far[0])
+            l2p_pass(k, *this, far, locals);
+        }
+    });
+
+    for (size_t i = 0; i < n_out; i++) {
+        out[i] += far[i];
     }
+
+    workspaces->give_back(std::move(ws));
 }
 
+// The dense kernel matrix from an equivalent surface around src_bounds to a
+// check surface around obs_bounds.
 template <size_t dim>
-std::vector<double> c2e_solve(std::vector<std::array<double,dim>> surf,
-    const Cube<dim>& bounds, double check_r, double equiv_r, const FMMConfig<dim>& cfg) 
+std::vector<double> surf_to_surf(const FMMConfig<dim>& cfg, const SoAPts<dim>& surf,
+    const Cube<dim>& obs_bounds, double obs_r, const Cube<dim>& src_bounds, double src_r)
 {
-    auto equiv_surf = inscribe_surf(bounds, equiv_r, surf);
-    auto check_surf = inscribe_surf(bounds, check_r, surf);
+    auto obs_surf = inscribe_surf_soa(obs_bounds, obs_r, surf);
+    auto src_surf = inscribe_surf_soa(src_bounds, src_r, surf);
 
     auto n_surf = surf.size();
     auto n_rows = n_surf * cfg.tensor_dim();
 
-    std::vector<double> equiv_to_check(n_rows * n_rows);
+    std::vector<double> op(n_rows * n_rows);
     cfg.kernel.f(
         {
-            check_surf.data(), surf.data(), 
-            equiv_surf.data(), surf.data(),
+            obs_surf.view(), surf.view(),
+            src_surf.view(), surf.view(),
             n_surf, n_surf,
             cfg.params.data()
         },
-        equiv_to_check.data());
+        op.data());
+    return op;
+}
+
+template <size_t dim>
+std::vector<double> c2e_solve(const SoAPts<dim>& surf,
+    const Cube<dim>& bounds, double check_r, double equiv_r, const FMMConfig<dim>& cfg) 
+{
+    auto n_rows = surf.size() * cfg.tensor_dim();
+    auto equiv_to_check = surf_to_surf(cfg, surf, bounds, check_r, bounds, equiv_r);
 
     // TODO: This should be much higher (1e-14 or so) if double precision is being used
     double eps = 1e-5; 
@@ -304,66 +1192,636 @@ std::vector<double> c2e_solve(std::vector<std::array<double,dim>> surf,
     return pinv;
 }
 
+// The row-major equiv_to_check matrix is the column-major transpose, so with
+// its SVD U * S * V^T the pseudoinverse is U * S^-1 * V^T over the kept
+// singular values. The factors are only smaller than the product when the
+// rank is below half of n_rows, otherwise the product is returned.
 template <size_t dim>
-void build_u2e(FMMMat<dim>& mat) {
-    int n_rows = mat.cfg.tensor_dim() * mat.surf.size();
-    mat.u2e_ops.resize((mat.src_tree.max_height + 1) * n_rows * n_rows);
+std::vector<double> c2e_svd_solve(const SoAPts<dim>& surf,
+    const Cube<dim>& bounds, double check_r, double equiv_r, const FMMConfig<dim>& cfg)
+{
+    int n_rows = surf.size() * cfg.tensor_dim();
+    auto equiv_to_check = surf_to_surf(cfg, surf, bounds, check_r, bounds, equiv_r);
+    auto svd = svd_decompose(equiv_to_check.data(), n_rows, n_rows);
+    auto sv = singular_values(svd);
+    int rank = svd_rank(svd, cfg.c2e_svd_tol * sv[0]);
+    auto U = left_singular_vectors(svd, rank);
+    auto Vt = right_singular_vectors(svd, rank);
+
+    std::vector<double> factors(2 * n_rows * rank);
+    for (int i = 0; i < n_rows; i++) {
+        for (int j = 0; j < rank; j++) {
+            factors[i * rank + j] = U[j * n_rows + i] / sv[j];
+        }
+    }
+    std::copy(Vt.begin(), Vt.end(), factors.begin() + n_rows * rank);
+    if (2 * rank < n_rows) {
+        return factors;
+    }
+    return dense_c2e_ops({DenseOp(std::move(factors))}, n_rows);
+}
+
+std::vector<double> dense_c2e_ops(const std::vector<DenseOp>& ops, int n_rows) {
+    std::vector<double> out(ops.size() * n_rows * n_rows, 0.0);
+    for (size_t op_idx = 0; op_idx < ops.size(); op_idx++) {
+        auto* op = ops[op_idx].data();
+        auto* dense = &out[op_idx * n_rows * n_rows];
+        if (ops[op_idx].size() == size_t(n_rows * n_rows)) {
+            std::copy(op, op + n_rows * n_rows, dense);
+            continue;
+        }
+        int rank = ops[op_idx].size() / (2 * n_rows);
+        auto* Vt = op + n_rows * rank;
+        for (int i = 0; i < n_rows; i++) {
+            for (int k = 0; k < rank; k++) {
+                for (int j = 0; j < n_rows; j++) {
+                    dense[i * n_rows + j] += op[i * rank + k] * Vt[k * n_rows + j];
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Builds the missing dense operators used by the node pairs in lists.
+template <typename TreeT>
+void build_translation_ops(std::vector<std::vector<double>>& ops,
+    const FMMMat<TreeT>& mat, const TreeT& tree, const std::vector<MatrixFreeOp>& lists,
+    bool parent_is_obs, double obs_r, double src_r)
+{
+    const size_t dim = TreeT::spatial_dim;
+    ops.resize(tree.max_height << dim);
+    std::vector<bool> needed(ops.size(), false);
+    for (auto& op: lists) {
+        for (size_t i = 0; i < op.size(); i++) {
+            auto& obs_n = tree.nodes[op.obs_n_idx[i]];
+            auto& src_n = tree.nodes[op.src_n_idx[i]];
+            int op_idx = parent_is_obs ?
+                translation_op_idx(tree, obs_n, src_n) :
+                translation_op_idx(tree, src_n, obs_n);
+            if (op_idx >= 0 && ops[op_idx].size() == 0) {
+                needed[op_idx] = true;
+            }
+        }
+    }
+
+#pragma omp parallel for
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (!needed[i]) {
+            continue;
+        }
+        Cube<dim> parent(std::array<double,dim>{}, tree.level_width(i >> dim));
+        auto child = get_subcell(parent, make_child_idx<dim>(i % (1 << dim)));
+        if (parent_is_obs) {
+            ops[i] = surf_to_surf(mat.cfg, mat.surf, parent, obs_r, child, src_r);
+        } else {
+            ops[i] = surf_to_surf(mat.cfg, mat.surf, child, obs_r, parent, src_r);
+        }
+    }
+}
+
+template <typename TreeT>
+void build_m2m(FMMMat<TreeT>& mat) {
+    build_translation_ops(
+        mat.m2m_ops, mat, *mat.src_tree, mat.m2m, true, mat.cfg.outer_r, mat.cfg.inner_r
+    );
+}
+
+template <typename TreeT>
+void build_l2l(FMMMat<TreeT>& mat) {
+    build_translation_ops(
+        mat.l2l_ops, mat, *mat.obs_tree, mat.l2l, false, mat.cfg.inner_r, mat.cfg.outer_r
+    );
+}
+
+// An m2l operator only depends on the bounds levels of the two nodes and the
+// offset between them. The offset is counted in units of the smaller node
+// width, so nodes from one grid get an exact integer key. Returns false for
+// nodes that are off the grid, like shrunk adaptive bounds.
+template <typename TreeT>
+bool m2l_key(const typename TreeT::Node& obs_n, const typename TreeT::Node& src_n,
+    std::array<int,TreeT::spatial_dim + 2>& key)
+{
+    const size_t dim = TreeT::spatial_dim;
+    key[0] = obs_n.bounds_level;
+    key[1] = src_n.bounds_level;
+    double unit = std::min(obs_n.bounds.width, src_n.bounds.width);
+    for (size_t d = 0; d < dim; d++) {
+        double offset = (src_n.bounds.center[d] - obs_n.bounds.center[d]) / unit;
+        double rounded = std::round(offset);
+        if (std::fabs(offset - rounded) > 1e-8 || std::fabs(rounded) > 1e6) {
+            return false;
+        }
+        key[2 + d] = static_cast<int>(rounded);
+    }
+    return true;
+}
+
+// The operators between a pair of levels are compressed like in the black
+// box FMM. Their shared column space comes from the SVD of sum(op * op^T) and
+// their row space from sum(op^T * op), so each operator becomes
+// U * (U^T * op * V) * V^T with a small core.
+template <typename TreeT>
+void compress_m2l_ops(FMMMat<TreeT>& mat) {
+    mat.m2l_bases.clear();
+    mat.m2l_svd_ops.clear();
+    mat.m2l_op_basis.clear();
+    if (mat.cfg.m2l_svd_tol <= 0 || mat.m2l_ops.size() == 0) {
+        return;
+    }
+
+    std::map<std::array<int,2>,int> basis_idxs;
+    std::vector<std::vector<size_t>> basis_ops;
+    mat.m2l_op_basis.resize(mat.m2l_ops.size());
+    for (size_t i = 0; i < mat.m2l_ops.size(); i++) {
+        std::array<int,2> levels{mat.m2l_op_keys[i][0], mat.m2l_op_keys[i][1]};
+        auto inserted = basis_idxs.insert({levels, basis_ops.size()});
+        if (inserted.second) {
+            basis_ops.emplace_back();
+        }
+        basis_ops[inserted.first->second].push_back(i);
+        mat.m2l_op_basis[i] = inserted.first->second;
+    }
+
+    int n_rows = mat.tensor_dim() * mat.surf.size();
+    double sv_threshold = mat.cfg.m2l_svd_tol * mat.cfg.m2l_svd_tol;
+    mat.m2l_bases.resize(basis_ops.size());
+    mat.m2l_svd_ops.resize(mat.m2l_ops.size());
+    for (size_t b = 0; b < basis_ops.size(); b++) {
+        auto& ops = basis_ops[b];
+        std::vector<double> col_gram(n_rows * n_rows, 0.0);
+        std::vector<double> row_gram(n_rows * n_rows, 0.0);
+#pragma omp parallel
+        {
+            std::vector<double> thread_col(n_rows * n_rows, 0.0);
+            std::vector<double> thread_row(n_rows * n_rows, 0.0);
+#pragma omp for
+            for (size_t i = 0; i < ops.size(); i++) {
+                auto& op = mat.m2l_ops[ops[i]];
+                auto col = mat_mult(n_rows, n_rows, false, op, true, op);
+                auto row = mat_mult(n_rows, n_rows, true, op, false, op);
+                for (size_t j = 0; j < col.size(); j++) {
+                    thread_col[j] += col[j];
+                    thread_row[j] += row[j];
+                }
+            }
+#pragma omp critical
+            for (size_t j = 0; j < col_gram.size(); j++) {
+                col_gram[j] += thread_col[j];
+                row_gram[j] += thread_row[j];
+            }
+        }
+
+        // The singular values of the gram matrices are the squares of the
+        // singular values of the operators.
+        auto col_svd = svd_decompose(col_gram.data(), n_rows, n_rows);
+        auto row_svd = svd_decompose(row_gram.data(), n_rows, n_rows);
+        int rank = std::max(
+            svd_rank(col_svd, sv_threshold * singular_values(col_svd)[0]),
+            svd_rank(row_svd, sv_threshold * singular_values(row_svd)[0])
+        );
+        rank = std::max(rank, 1);
+
+        auto& basis = mat.m2l_bases[b];
+        basis.rank = rank;
+        auto Ut = left_singular_vectors(col_svd, rank);
+        basis.Vt = left_singular_vectors(row_svd, rank);
+        basis.U.resize(n_rows * rank);
+        std::vector<double> V(n_rows * rank);
+        for (int i = 0; i < rank; i++) {
+            for (int j = 0; j < n_rows; j++) {
+                basis.U[j * rank + i] = Ut[i * n_rows + j];
+                V[j * rank + i] = basis.Vt[i * n_rows + j];
+            }
+        }
+
 #pragma omp parallel for
-    for (int i = 0; i < mat.src_tree.max_height + 1; i++) {
-        double width = mat.src_tree.root().bounds.width / std::pow(2.0, static_cast<double>(i));
-        std::array<double,dim> center{};
-        Cube<dim> bounds(center, width);
-        auto pinv = c2e_solve(mat.surf, bounds, mat.cfg.outer_r, mat.cfg.inner_r, mat.cfg);
-        double* op_start = &mat.u2e_ops[i * n_rows * n_rows];
-        for (int j = 0; j < n_rows * n_rows; j++) {
-            op_start[j] = pinv[j];
+        for (size_t i = 0; i < ops.size(); i++) {
+            auto projected = mat_mult(rank, n_rows, false, Ut, false, mat.m2l_ops[ops[i]]);
+            mat.m2l_svd_ops[ops[i]] = mat_mult(rank, rank, false, projected, false, V);
         }
     }
 }
 
-//TODO: This can be refactored to share lots of code with above.
+// The FFT m2l needs the kernel between two surface grids to be a convolution,
+// so the kernel can only depend on the obs to src vector and not on normals.
 template <size_t dim>
-void build_d2e(FMMMat<dim>& mat) {
-    int n_rows = mat.cfg.tensor_dim() * mat.surf.size();
-    mat.d2e_ops.resize((mat.obs_tree.max_height + 1) * n_rows * n_rows);
+bool translation_invariant(const Kernel<dim>& kernel) {
+    return !kernel.needs_obsn && !kernel.needs_srcn;
+}
+
+// The Fourier transformed kernel from the src surface grid to the obs surface
+// grid, sampled at every offset between two grid points. The blocks for each
+// pair of tensor components are stored one after the other.
+template <typename TreeT>
+std::vector<std::complex<double>> fft_m2l_op(const FMMMat<TreeT>& mat,
+    const Cube<TreeT::spatial_dim>& obs_bounds, const Cube<TreeT::spatial_dim>& src_bounds,
+    size_t side, const FFT& fft)
+{
+    const size_t dim = TreeT::spatial_dim;
+    int td = mat.tensor_dim();
+    size_t n_grid = std::pow(fft.size(), dim);
+    size_t n_steps = 2 * side - 1;
+    size_t n_offsets = std::pow(n_steps, dim);
+    double spacing = 2 * obs_bounds.width * mat.cfg.inner_r / (side - 1);
+
+    SoAPts<dim> offsets(n_offsets);
+    std::vector<size_t> offset_idx(n_offsets, 0);
+    for (size_t i = 0; i < n_offsets; i++) {
+        size_t rest = i;
+        size_t grid_stride = 1;
+        for (int d = dim - 1; d >= 0; d--) {
+            int step = static_cast<int>(rest % n_steps) - static_cast<int>(side - 1);
+            rest /= n_steps;
+            offsets.xs[d * n_offsets + i] =
+                obs_bounds.center[d] - src_bounds.center[d] + spacing * step;
+            offset_idx[i] += ((step + fft.size()) % fft.size()) * grid_stride;
+            grid_stride *= fft.size();
+        }
+    }
+    SoAPts<dim> origin(1);
+
+    std::vector<double> samples(n_offsets * td * td);
+    mat.cfg.kernel.f(
+        {
+            offsets.view(), offsets.view(),
+            origin.view(), origin.view(),
+            n_offsets, 1,
+            mat.cfg.params.data()
+        },
+        samples.data());
+
+    std::vector<std::complex<double>> op(td * td * n_grid);
+    for (int c1 = 0; c1 < td; c1++) {
+        for (int c2 = 0; c2 < td; c2++) {
+            auto* grid = &op[(c1 * td + c2) * n_grid];
+            for (size_t i = 0; i < n_offsets; i++) {
+                grid[offset_idx[i]] = samples[(i * td + c1) * td + c2];
+            }
+            fft.forward_grid(grid, dim);
+        }
+    }
+    return op;
+}
+
+// Builds the FFT operators for the keys in fft_keys, keeping operators that
+// were built before for the same key.
+template <typename TreeT>
+void build_m2l_fft(FMMMat<TreeT>& mat,
+    const std::vector<std::array<int,TreeT::spatial_dim + 2>>& keys,
+    const std::vector<size_t>& first_entry, const std::vector<bool>& fft_keys,
+    const std::vector<int>& entry_keys)
+{
+    typedef std::array<int,TreeT::spatial_dim + 2> Key;
+    std::vector<int> op_idxs(keys.size(), -1);
+    std::vector<size_t> op_entries;
+    std::vector<Key> op_keys;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (fft_keys[i]) {
+            op_idxs[i] = op_keys.size();
+            op_keys.push_back(keys[i]);
+            op_entries.push_back(first_entry[i]);
+        }
+    }
+
+    std::map<Key,size_t> old_idxs;
+    for (size_t i = 0; i < mat.m2l_fft_keys.size(); i++) {
+        old_idxs[mat.m2l_fft_keys[i]] = i;
+    }
+    std::vector<std::vector<std::complex<double>>> ops(op_keys.size());
+    for (size_t i = 0; i < op_keys.size(); i++) {
+        auto it = old_idxs.find(op_keys[i]);
+        if (it != old_idxs.end()) {
+            ops[i] = std::move(mat.m2l_fft_ops[it->second]);
+        }
+    }
+    mat.m2l_fft_ops = std::move(ops);
+    mat.m2l_fft_keys = std::move(op_keys);
+
+    size_t side = cube_surface_side<TreeT::spatial_dim>(mat.cfg.order);
+    FFT fft(fft_m2l_size(side));
 #pragma omp parallel for
-    for (int i = 0; i < mat.obs_tree.max_height + 1; i++) {
-        double width = mat.obs_tree.root().bounds.width / std::pow(2.0, static_cast<double>(i));
-        std::array<double,dim> center{};
-        Cube<dim> bounds(center, width);
-        auto pinv = c2e_solve(mat.surf, bounds, mat.cfg.inner_r, mat.cfg.outer_r, mat.cfg);
-        double* op_start = &mat.d2e_ops[i * n_rows * n_rows];
-        for (int j = 0; j < n_rows * n_rows; j++) {
-            op_start[j] = pinv[j];
+    for (size_t i = 0; i < mat.m2l_fft_ops.size(); i++) {
+        if (mat.m2l_fft_ops[i].size() > 0) {
+            continue;
         }
+        auto& obs_n = mat.obs_tree->nodes[mat.m2l.obs_n_idx[op_entries[i]]];
+        auto& src_n = mat.src_tree->nodes[mat.m2l.src_n_idx[op_entries[i]]];
+        mat.m2l_fft_ops[i] = fft_m2l_op(mat, obs_n.bounds, src_n.bounds, side, fft);
+    }
+
+    mat.m2l_fft_idx.resize(mat.m2l.size());
+    for (size_t i = 0; i < mat.m2l.size(); i++) {
+        mat.m2l_fft_idx[i] = entry_keys[i] < 0 ? -1 : op_idxs[entry_keys[i]];
     }
 }
 
+// Caches the m2l operators in order of how many entries use them, until the
+// memory budget in cfg.m2l_cache_bytes runs out. Operators already in the
+// cache with the same key are kept. With cfg.fft_m2l, the keys between
+// nodes of the same width get an FFT operator instead, which is much smaller
+// and does not count against the budget.
+template <typename TreeT>
+void build_m2l_cache(FMMMat<TreeT>& mat) {
+    typedef std::array<int,TreeT::spatial_dim + 2> Key;
+    std::map<Key,size_t> key_idxs;
+    std::vector<Key> keys;
+    std::vector<size_t> counts;
+    std::vector<size_t> first_entry;
+    std::vector<int> entry_keys(mat.m2l.size(), -1);
+    for (size_t i = 0; i < mat.m2l.size(); i++) {
+        auto& obs_n = mat.obs_tree->nodes[mat.m2l.obs_n_idx[i]];
+        auto& src_n = mat.src_tree->nodes[mat.m2l.src_n_idx[i]];
+        Key key;
+        if (!m2l_key<TreeT>(obs_n, src_n, key)) {
+            continue;
+        }
+        auto inserted = key_idxs.insert({key, counts.size()});
+        if (inserted.second) {
+            keys.push_back(key);
+            counts.push_back(0);
+            first_entry.push_back(i);
+        }
+        entry_keys[i] = inserted.first->second;
+        counts[entry_keys[i]]++;
+    }
+
+    std::vector<bool> fft_keys(keys.size(), false);
+    for (size_t i = 0; mat.cfg.fft_m2l && i < keys.size(); i++) {
+        auto& obs_n = mat.obs_tree->nodes[mat.m2l.obs_n_idx[first_entry[i]]];
+        auto& src_n = mat.src_tree->nodes[mat.m2l.src_n_idx[first_entry[i]]];
+        fft_keys[i] = keys[i][0] == keys[i][1] &&
+            std::fabs(obs_n.bounds.width - src_n.bounds.width) <= 1e-12 * obs_n.bounds.width;
+    }
+    build_m2l_fft(mat, keys, first_entry, fft_keys, entry_keys);
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (!fft_keys[i]) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&] (size_t a, size_t b) { return counts[a] > counts[b]; });
+
+    size_t n_rows = mat.tensor_dim() * mat.surf.size();
+    size_t op_bytes = n_rows * n_rows * sizeof(double);
+    size_t n_cached = std::min(order.size(), mat.cfg.m2l_cache_bytes / op_bytes);
+    std::vector<int> op_idxs(counts.size(), -1);
+    for (size_t i = 0; i < n_cached; i++) {
+        op_idxs[order[i]] = i;
+    }
+
+    std::vector<std::vector<double>> ops(n_cached);
+    std::vector<Key> op_keys(n_cached);
+    for (size_t i = 0; i < n_cached; i++) {
+        op_keys[i] = keys[order[i]];
+    }
+    for (size_t i = 0; i < mat.m2l_ops.size(); i++) {
+        auto it = key_idxs.find(mat.m2l_op_keys[i]);
+        if (it != key_idxs.end() && op_idxs[it->second] >= 0) {
+            ops[op_idxs[it->second]] = std::move(mat.m2l_ops[i]);
+        }
+    }
+    mat.m2l_ops = std::move(ops);
+    mat.m2l_op_keys = std::move(op_keys);
+
+#pragma omp parallel for
+    for (size_t i = 0; i < n_cached; i++) {
+        if (mat.m2l_ops[i].size() > 0) {
+            continue;
+        }
+        auto entry = first_entry[order[i]];
+        auto& obs_n = mat.obs_tree->nodes[mat.m2l.obs_n_idx[entry]];
+        auto& src_n = mat.src_tree->nodes[mat.m2l.src_n_idx[entry]];
+        mat.m2l_ops[i] = surf_to_surf(
+            mat.cfg, mat.surf, obs_n.bounds, mat.cfg.inner_r, src_n.bounds, mat.cfg.inner_r
+        );
+    }
+
+    mat.m2l_op_idx.resize(mat.m2l.size());
+    for (size_t i = 0; i < mat.m2l.size(); i++) {
+        mat.m2l_op_idx[i] = entry_keys[i] < 0 ? -1 : op_idxs[entry_keys[i]];
+    }
+
+    compress_m2l_ops(mat);
+}
+
+// Everything a check to equivalent operator depends on, for the operator
+// cache. For a non-homogeneous kernel that includes the absolute width of
+// the level, so operators are only reused by trees whose root cells have
+// exactly the same width.
 template <size_t dim>
-FMMMat<dim> fmmmmmmm(const Octree<dim>& obs_tree, const Octree<dim>& src_tree,
-                const FMMConfig<dim>& cfg) {
+std::string c2e_key(const FMMConfig<dim>& cfg, const SoAPts<dim>& surf,
+    double width, double check_r, double equiv_r)
+{
+    std::string key = "c2e kernel=" + cfg.kernel_name() + " params=";
+    for (auto p: cfg.params) {
+        key += key_double(p) + ",";
+    }
+    if (cfg.c2e_svd_tol > 0) {
+        key += " svd_tol=" + key_double(cfg.c2e_svd_tol);
+    }
+    key += " check_r=" + key_double(check_r) + " equiv_r=" + key_double(equiv_r) +
+        " width=" + key_double(width) + " surf=";
+    for (auto x: surf.xs) {
+        key += key_double(x) + ",";
+    }
+    return key;
+}
+
+// The check to equivalent surface operators for each bounds level of the
+// tree. The kernel between the surfaces of a cell s times wider is
+// s^homogeneity times larger, so for a homogeneous kernel the pseudoinverse
+// for a cell of width w is the unit cell one scaled by w^-homogeneity. Only
+// the unit cell operator is needed then, whatever the size of the tree.
+template <typename TreeT>
+void build_c2e(const FMMMat<TreeT>& mat, const TreeT& tree, double check_r, double equiv_r,
+    std::vector<DenseOp>& ops, std::vector<double>& scales)
+{
+    const size_t dim = TreeT::spatial_dim;
+    int n_levels = tree.max_height + 1;
+    int n_ops = mat.c2e_op_idx(n_levels - 1) + 1;
+    OpCache cache(mat.cfg.op_cache_dir);
+    ops.resize(n_ops);
+    scales.resize(n_levels);
+#pragma omp parallel for
+    for (int i = 0; i < n_ops; i++) {
+        double width = mat.cfg.kernel.homogeneous ? 1.0 : tree.level_width(i);
+        ops[i] = cache.get(c2e_key(mat.cfg, mat.surf, width, check_r, equiv_r), [&] () {
+            Cube<dim> bounds(std::array<double,dim>{}, width);
+            if (mat.cfg.c2e_svd_tol > 0) {
+                return c2e_svd_solve(mat.surf, bounds, check_r, equiv_r, mat.cfg);
+            }
+            return c2e_solve(mat.surf, bounds, check_r, equiv_r, mat.cfg);
+        });
+    }
+    for (int i = 0; i < n_levels; i++) {
+        scales[i] = 1.0;
+        if (mat.cfg.kernel.homogeneous) {
+            scales[i] = std::pow(tree.level_width(i), -mat.cfg.kernel.homogeneity);
+        }
+    }
+}
+
+template <typename TreeT>
+void build_u2e(FMMMat<TreeT>& mat) {
+    build_c2e(mat, *mat.src_tree, mat.cfg.outer_r, mat.cfg.inner_r, mat.u2e_ops, mat.u2e_scales);
+}
+
+template <typename TreeT>
+void build_d2e(FMMMat<TreeT>& mat) {
+    build_c2e(mat, *mat.obs_tree, mat.cfg.inner_r, mat.cfg.outer_r, mat.d2e_ops, mat.d2e_scales);
+}
+
+template <typename TreeT>
+std::vector<Cube<TreeT::spatial_dim>> node_bounds(const TreeT& tree) {
+    std::vector<Cube<TreeT::spatial_dim>> out;
+    for (auto& n: tree.nodes) {
+        out.push_back(n.bounds);
+    }
+    return out;
+}
+
+template <typename TreeT>
+bool same_bounds(const TreeT& tree, const std::vector<Cube<TreeT::spatial_dim>>& bounds) {
+    for (size_t i = 0; i < tree.nodes.size(); i++) {
+        auto& b = tree.nodes[i].bounds;
+        if (b.center != bounds[i].center || b.width != bounds[i].width) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    auto translation_surf = surrounding_surface<dim>(cfg.order);
+template <typename TreeT>
+bool FMMMat<TreeT>::refit(const std::array<double,dim>* obs_pts,
+    const std::array<double,dim>* obs_normals,
+    const std::array<double,dim>* src_pts,
+    const std::array<double,dim>* src_normals)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(*state_mutex);
+
+    // The trees may be shared, so the moved points go into new copies.
+    auto new_obs_tree = std::make_shared<TreeT>(*obs_tree);
+    if (!new_obs_tree->refit(obs_pts, obs_normals)) {
+        return false;
+    }
+    auto new_src_tree = new_obs_tree;
+    if (obs_tree != src_tree || obs_pts != src_pts || obs_normals != src_normals) {
+        new_src_tree = std::make_shared<TreeT>(*src_tree);
+        if (!new_src_tree->refit(src_pts, src_normals)) {
+            return false;
+        }
+    }
+
+    auto obs_bounds = node_bounds(*obs_tree);
+    auto src_bounds = node_bounds(*src_tree);
+    double obs_width = obs_tree->level_width(0);
+    double src_width = src_tree->level_width(0);
+    obs_tree = new_obs_tree;
+    src_tree = new_src_tree;
+
+    // The translation operators only depend on the width of each level.
+    if (src_tree->level_width(0) != src_width) {
+        build_u2e(*this);
+        m2m_ops.clear();
+    }
+    if (obs_tree->level_width(0) != obs_width) {
+        build_d2e(*this);
+        l2l_ops.clear();
+    }
+    if (src_tree->level_width(0) != src_width || obs_tree->level_width(0) != obs_width) {
+        m2l_ops.clear();
+        m2l_op_keys.clear();
+        m2l_fft_ops.clear();
+        m2l_fft_keys.clear();
+    }
+
+    // The tree topology is unchanged, but the point ranges of the nodes may
+    // have shifted.
+    up_collect(*this);
+    down_collect(*this);
+
+    if (!same_bounds(*obs_tree, obs_bounds) || !same_bounds(*src_tree, src_bounds)) {
+        traverse(*this);
+        prune(*this);
+        group_by_obs(*this);
+        build_m2m(*this);
+        build_l2l(*this);
+        build_m2l_cache(*this);
+        return true;
+    }
+
+    // With the same bounds, the same pairs of nodes interact. Only the number
+    // of points in each node can change whether a well separated pair uses
+    // the approximation.
+    Interactions<MatrixFreeOp> out;
+    for (auto* op: {&p2p, &m2p, &p2l, &m2l}) {
+        for (size_t i = 0; i < op->obs_n_idx.size(); i++) {
+            auto& obs_n = obs_tree->nodes[op->obs_n_idx[i]];
+            auto& src_n = src_tree->nodes[op->src_n_idx[i]];
+            if (op == &p2p && !well_separated(*this, obs_n, src_n)) {
+                out[P2P].insert(obs_n, src_n);
+            } else {
+                insert_far_field(*this, out, obs_n, src_n);
+            }
+        }
+    }
+    store_interactions(*this, std::move(out));
+    prune(*this);
+    group_by_obs(*this);
+    build_m2m(*this);
+    build_l2l(*this);
+    build_m2l_cache(*this);
+    return true;
+}
+
+template <typename TreeT>
+FMMMat<TreeT> fmmmmmmm(std::shared_ptr<const TreeT> obs_tree,
+    std::shared_ptr<const TreeT> src_tree, const FMMConfig<TreeT::spatial_dim>& cfg)
+{
 
-    FMMMat<dim> mat(obs_tree, src_tree, cfg, translation_surf);
+    const size_t dim = TreeT::spatial_dim;
+    std::vector<std::array<double,dim>> translation_surf;
+    if (cfg.fft_m2l) {
+        if (!translation_invariant(cfg.kernel)) {
+            throw std::runtime_error("fft m2l needs a kernel that does not use normals");
+        }
+        translation_surf = cube_surface<dim>(cube_surface_side<dim>(cfg.order));
+    } else {
+        translation_surf = surrounding_surface<dim>(cfg.order);
+    }
 
-    mat.m2m.resize(mat.src_tree.max_height + 1);
-    mat.l2l.resize(mat.obs_tree.max_height + 1);
-    mat.u2e.resize(mat.src_tree.max_height + 1);
-    mat.d2e.resize(mat.obs_tree.max_height + 1);
+    FMMMat<TreeT> mat(obs_tree, src_tree, cfg, translation_surf);
 
     build_u2e(mat);
     build_d2e(mat);
-    up_collect(mat, mat.src_tree.root());
-    down_collect(mat, mat.obs_tree.root());
-    traverse(mat, mat.obs_tree.root(), mat.src_tree.root());
+    up_collect(mat);
+    down_collect(mat);
+    traverse(mat);
+    prune(mat);
+    group_by_obs(mat);
+    build_m2m(mat);
+    build_l2l(mat);
+    build_m2l_cache(mat);
 
     return mat;
 }
 
 template 
-FMMMat<2> fmmmmmmm(const Octree<2>& obs_tree, const Octree<2>& src_tree, const FMMConfig<2>& cfg);
+FMMMat<Octree<2>> fmmmmmmm(std::shared_ptr<const Octree<2>> obs_tree,
+    std::shared_ptr<const Octree<2>> src_tree, const FMMConfig<2>& cfg);
+template 
+FMMMat<Octree<3>> fmmmmmmm(std::shared_ptr<const Octree<3>> obs_tree,
+    std::shared_ptr<const Octree<3>> src_tree, const FMMConfig<3>& cfg);
+template 
+FMMMat<KDTree<2>> fmmmmmmm(std::shared_ptr<const KDTree<2>> obs_tree,
+    std::shared_ptr<const KDTree<2>> src_tree, const FMMConfig<2>& cfg);
 template 
-FMMMat<3> fmmmmmmm(const Octree<3>& obs_tree, const Octree<3>& src_tree, const FMMConfig<3>& cfg);
-template struct FMMMat<2>;
-template struct FMMMat<3>;
+FMMMat<KDTree<3>> fmmmmmmm(std::shared_ptr<const KDTree<3>> obs_tree,
+    std::shared_ptr<const KDTree<3>> src_tree, const FMMConfig<3>& cfg);
+template struct FMMMat<Octree<2>>;
+template struct FMMMat<Octree<3>>;
+template struct FMMMat<KDTree<2>>;
+template struct FMMMat<KDTree<3>>;
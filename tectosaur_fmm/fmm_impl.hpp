@@ -1,11 +1,16 @@
 #pragma once
 
 #include <cmath>
+#include <complex>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include "fmm_kernels.hpp"
 #include "octree.hpp"
+#include "kdtree.hpp"
 #include "blas_wrapper.hpp"
+#include "op_cache.hpp"
 #include "translation_surf.hpp"
 
 template <size_t dim>
@@ -20,14 +25,63 @@ struct FMMConfig {
     Kernel<dim> kernel;
     std::vector<double> params;
 
+    // The memory that dense m2l operators may use. m2l entries without a
+    // cached operator are evaluated matrix free.
+    size_t m2l_cache_bytes = default_m2l_cache_bytes;
+    static const size_t default_m2l_cache_bytes = size_t(512) << 20;
+
+    // With a positive m2l_svd_tol, the cached m2l operators between each pair
+    // of levels are compressed onto shared low rank bases, dropping the
+    // singular values below m2l_svd_tol times the largest.
+    double m2l_svd_tol = 0.0;
+
+    // With fft_m2l, the translation surface is a regular grid of at least
+    // order points on a cube and the m2l translations between nodes of the
+    // same width are applied as FFT convolutions. This needs a kernel that
+    // only depends on the obs to src vector, like laplaceS or elasticU.
+    bool fft_m2l = false;
+
+    // The memory for the transformed multipoles that fft_m2l holds at once.
+    // Larger levels are translated in batches of obs nodes.
+    size_t fft_m2l_bytes = default_fft_m2l_bytes;
+    static const size_t default_fft_m2l_bytes = size_t(64) << 20;
+
+    // With a positive c2e_svd_tol, the u2e and d2e operators are kept as the
+    // two thin factors of their truncated SVD pseudoinverse, dropping the
+    // singular values below c2e_svd_tol times the largest.
+    double c2e_svd_tol = 0.0;
+
+    // A directory for the u2e and d2e operators, shared by every FMM with the
+    // same kernel, params, order and radii. The operators of a
+    // non-homogeneous kernel also depend on the absolute cell widths, so
+    // they are only shared between trees with exactly the same root width.
+    // Missing parent directories are created. Empty disables it.
+    std::string op_cache_dir;
+
     std::string kernel_name() const { return kernel.name; }
     int tensor_dim() const { return kernel.tensor_dim; }
 };
 
 template <size_t dim>
-std::vector<double> c2e_solve(std::vector<std::array<double,dim>> surf,
+const size_t FMMConfig<dim>::default_m2l_cache_bytes;
+template <size_t dim>
+const size_t FMMConfig<dim>::default_fft_m2l_bytes;
+
+template <size_t dim>
+std::vector<double> c2e_solve(const SoAPts<dim>& surf,
+    const Cube<dim>& bounds, double check_r, double equiv_r, const FMMConfig<dim>& cfg);
+
+// The c2e operator as an (n_rows x rank) factor followed by a (rank x n_rows)
+// factor, with the inverse singular values folded into the first, or as the
+// dense (n_rows x n_rows) product if that is smaller.
+template <size_t dim>
+std::vector<double> c2e_svd_solve(const SoAPts<dim>& surf,
     const Cube<dim>& bounds, double check_r, double equiv_r, const FMMConfig<dim>& cfg);
 
+// The c2e operators multiplied out into dense (n_rows x n_rows) operators,
+// one after another.
+std::vector<double> dense_c2e_ops(const std::vector<DenseOp>& ops, int n_rows);
+
 struct MatrixFreeOp {
     std::vector<int> obs_n_start;
     std::vector<int> obs_n_end;
@@ -36,8 +90,31 @@ struct MatrixFreeOp {
     std::vector<int> src_n_end;
     std::vector<int> src_n_idx;
 
-    template <size_t dim>
-    void insert(const OctreeNode<dim>& obs_n, const OctreeNode<dim>& src_n) {
+    // Once the entries are final, group_by_obs sorts them into groups that
+    // write to separate outputs, like the rows of a CSR matrix. Group g is the
+    // entries from group_starts[g] up to group_starts[g + 1].
+    std::vector<int> group_starts;
+
+    size_t size() const { return obs_n_idx.size(); }
+
+    void resize(size_t n) {
+        for (auto* v: {&obs_n_start, &obs_n_end, &obs_n_idx, &src_n_start, &src_n_end, &src_n_idx}) {
+            v->resize(n);
+        }
+    }
+
+    template <typename NodeT>
+    void set(size_t i, const NodeT& obs_n, const NodeT& src_n) {
+        obs_n_start[i] = obs_n.start;
+        obs_n_end[i] = obs_n.end;
+        obs_n_idx[i] = obs_n.idx;
+        src_n_start[i] = src_n.start;
+        src_n_end[i] = src_n.end;
+        src_n_idx[i] = src_n.idx;
+    }
+
+    template <typename NodeT>
+    void insert(const NodeT& obs_n, const NodeT& src_n) {
         obs_n_start.push_back(obs_n.start);
         obs_n_end.push_back(obs_n.end);
         obs_n_idx.push_back(obs_n.idx);
@@ -45,14 +122,69 @@ struct MatrixFreeOp {
         src_n_end.push_back(src_n.end);
         src_n_idx.push_back(src_n.idx);
     }
+
+    void append(const MatrixFreeOp& other) {
+        obs_n_start.insert(obs_n_start.end(), other.obs_n_start.begin(), other.obs_n_start.end());
+        obs_n_end.insert(obs_n_end.end(), other.obs_n_end.begin(), other.obs_n_end.end());
+        obs_n_idx.insert(obs_n_idx.end(), other.obs_n_idx.begin(), other.obs_n_idx.end());
+        src_n_start.insert(src_n_start.end(), other.src_n_start.begin(), other.src_n_start.end());
+        src_n_end.insert(src_n_end.end(), other.src_n_end.begin(), other.src_n_end.end());
+        src_n_idx.insert(src_n_idx.end(), other.src_n_idx.begin(), other.src_n_idx.end());
+    }
 };
 
-template <size_t dim>
+// The number of upward and downward pass entries dropped because the
+// multipoles or locals they compute are never used.
+struct PruneCounts {
+    size_t p2m = 0;
+    size_t m2m = 0;
+    size_t u2e = 0;
+    size_t l2l = 0;
+    size_t d2e = 0;
+    size_t l2p = 0;
+};
+
+// The shared bases of the compressed m2l operators between one pair of
+// levels: U is (n x rank) and Vt is (rank x n).
+struct M2LBasis {
+    int rank;
+    std::vector<double> U;
+    std::vector<double> Vt;
+};
+
+// The check surface values and the multipoles and locals of one eval, and
+// the far field part of its output.
+struct EvalWorkspace {
+    std::vector<double> m_check;
+    std::vector<double> multipoles;
+    std::vector<double> l_check;
+    std::vector<double> locals;
+    std::vector<double> far;
+};
+
+// Workspaces kept between evals so their buffers are only allocated once.
+// Concurrent evals each take a different one.
+class EvalWorkspacePool {
+public:
+    std::unique_ptr<EvalWorkspace> take();
+    void give_back(std::unique_ptr<EvalWorkspace> ws);
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<EvalWorkspace>> free;
+};
+
+// The obs and src trees can be any tree type with the same members as Octree,
+// like KDTree. The trees are shared rather than copied, so a self interaction
+// problem holds a single tree.
+template <typename TreeT>
 struct FMMMat {
-    Octree<dim> obs_tree;
-    Octree<dim> src_tree;
+    static const size_t dim = TreeT::spatial_dim;
+
+    std::shared_ptr<const TreeT> obs_tree;
+    std::shared_ptr<const TreeT> src_tree;
     FMMConfig<dim> cfg;
-    std::vector<std::array<double,dim>> surf;
+    SoAPts<dim> surf;
 
     MatrixFreeOp p2m;
     std::vector<MatrixFreeOp> m2m;
@@ -63,17 +195,87 @@ struct FMMMat {
     MatrixFreeOp m2p;
     MatrixFreeOp l2p;
 
-    std::vector<double> u2e_ops;
+    // Dense m2m and l2l operators for each parent bounds level and child
+    // octant, used for the children that are exactly a subcell of their
+    // parent. Only the operators that some node pair uses are built.
+    std::vector<std::vector<double>> m2m_ops;
+    std::vector<std::vector<double>> l2l_ops;
+
+    // Dense operators for the most common m2l translations, with the (obs
+    // level, src level, offset) key of each, and the operator used by each
+    // m2l entry, or -1 for entries evaluated matrix free.
+    std::vector<std::vector<double>> m2l_ops;
+    std::vector<std::array<int,dim + 2>> m2l_op_keys;
+    std::vector<int> m2l_op_idx;
+
+    // With cfg.m2l_svd_tol > 0, each cached m2l operator is approximated by
+    // U * m2l_svd_ops[i] * Vt using the basis m2l_op_basis[i].
+    std::vector<M2LBasis> m2l_bases;
+    std::vector<std::vector<double>> m2l_svd_ops;
+    std::vector<int> m2l_op_basis;
+
+    // With cfg.fft_m2l, the Fourier transformed kernel on the surface grid
+    // for each key of an m2l translation between nodes of the same width,
+    // and the transform used by each m2l entry, or -1.
+    std::vector<std::vector<std::complex<double>>> m2l_fft_ops;
+    std::vector<std::array<int,dim + 2>> m2l_fft_keys;
+    std::vector<int> m2l_fft_idx;
+
+    // The u2e or d2e operator for bounds level l is u2e_scales[l] or
+    // d2e_scales[l] times u2e_ops[c2e_op_idx(l)] or d2e_ops[c2e_op_idx(l)].
+    // For a homogeneous kernel, the only operator is the one for a unit cell.
+    // With cfg.c2e_svd_tol > 0, an operator may hold the two factors from
+    // c2e_svd_solve instead.
+    std::vector<DenseOp> u2e_ops;
+    std::vector<double> u2e_scales;
     std::vector<MatrixFreeOp> u2e;
 
-    std::vector<double> d2e_ops;
+    std::vector<DenseOp> d2e_ops;
+    std::vector<double> d2e_scales;
     std::vector<MatrixFreeOp> d2e;
 
-    FMMMat(Octree<dim> obs_tree, Octree<dim> src_tree, FMMConfig<dim> cfg,
+    PruneCounts pruned;
+
+    // eval sizes the buffers on every call, so copies of the matrix can
+    // share the pool.
+    std::shared_ptr<EvalWorkspacePool> workspaces = std::make_shared<EvalWorkspacePool>();
+
+    // Held shared by eval and exclusively by refit, which replaces the trees
+    // and rewrites the interaction lists and operators that evals read.
+    // Callers of the *_matvec passes hold it exclusively themselves.
+    std::shared_ptr<std::shared_timed_mutex> state_mutex =
+        std::make_shared<std::shared_timed_mutex>();
+
+    FMMMat(std::shared_ptr<const TreeT> obs_tree,
+        std::shared_ptr<const TreeT> src_tree, FMMConfig<dim> cfg,
         std::vector<std::array<double,dim>> surf);
 
     int tensor_dim() const { return cfg.tensor_dim(); }
 
+    bool self_interaction() const { return obs_tree == src_tree; }
+
+    int c2e_op_idx(int bounds_level) const {
+        return cfg.kernel.homogeneous ? 0 : bounds_level;
+    }
+
+    // Factored operators have rank < n_rows / 2, so their size tells them
+    // apart from dense ones.
+    int c2e_rank(const DenseOp& op) const {
+        size_t n_rows = tensor_dim() * surf.size();
+        return op.size() == n_rows * n_rows ? n_rows : op.size() / (2 * n_rows);
+    }
+
+    // Move the points of both trees, given in their original order, and bring
+    // the interaction lists up to date without rebuilding the operators. The
+    // refit trees are new copies, so other users of the old trees are not
+    // affected. Returns false and leaves the matrix unchanged if a tree could
+    // not be refit, in which case the trees and the matrix have to be rebuilt.
+    // Waits for running evals to finish.
+    bool refit(const std::array<double,dim>* obs_pts,
+        const std::array<double,dim>* obs_normals,
+        const std::array<double,dim>* src_pts,
+        const std::array<double,dim>* src_normals);
+
     void p2m_matvec(double* out, double* in);
     void m2m_matvec(double* out, double* in, int level);
     void p2l_matvec(double* out, double* in);
@@ -85,10 +287,28 @@ struct FMMMat {
     void d2e_matvec(double* out, double* in, int level);
     void u2e_matvec(double* out, double* in, int level);
 
+    // The whole matrix vector product, from tensor_dim values per src point
+    // to tensor_dim values per obs point, both in tree order. out is
+    // overwritten. Evals can run concurrently, and a refit waits for them.
+    void eval(double* out, const double* in);
+
     std::vector<double> m2m_eval(double* m_check);
     std::vector<double> m2p_eval(double* multipoles);
 };
 
-template <size_t dim>
-FMMMat<dim> fmmmmmmm(const Octree<dim>& obs_tree, const Octree<dim>& src_tree,
-    const FMMConfig<dim>& cfg);
+template <typename TreeT>
+FMMMat<TreeT> fmmmmmmm(std::shared_ptr<const TreeT> obs_tree,
+    std::shared_ptr<const TreeT> src_tree, const FMMConfig<TreeT::spatial_dim>& cfg);
+
+// Copies the trees, only once when obs_tree and src_tree are the same object.
+template <typename TreeT>
+FMMMat<TreeT> fmmmmmmm(const TreeT& obs_tree, const TreeT& src_tree,
+    const FMMConfig<TreeT::spatial_dim>& cfg)
+{
+    auto obs_ptr = std::make_shared<const TreeT>(obs_tree);
+    auto src_ptr = obs_ptr;
+    if (&obs_tree != &src_tree) {
+        src_ptr = std::make_shared<const TreeT>(src_tree);
+    }
+    return fmmmmmmm(obs_ptr, src_ptr, cfg);
+}
@@ -83,6 +83,21 @@ def report_interactions(fmm_mat):
     logger.debug('total p2p interactions: %e' % p2p_i)
     logger.debug('total m2p interactions: %e' % m2p_i)
     logger.debug('total l2p interactions: %e' % l2p_i)
+    pruned = fmm_mat.pruned
+    for name in ['p2m', 'm2m', 'u2e', 'l2l', 'd2e', 'l2p']:
+        logger.debug('pruned %s ops: %d' % (name, getattr(pruned, name)))
+
+    return dict(
+        p2m = p2m_i, m2m = m2m_i, p2l = p2l_i, m2l = m2l_i, l2l = l2l_i,
+        p2p = p2p_i, m2p = m2p_i, l2p = l2p_i, tree = tree_i, direct = direct_i
+    )
+
+# The c2e operator of each node and the scale it is applied with.
+def c2e_node_data(fmm_mat, nodes, scales):
+    levels = [n.bounds_level for n in nodes]
+    op_idx = np.array([fmm_mat.c2e_op_idx(l) for l in levels])
+    node_scales = np.array([scales[l] for l in levels])
+    return gpu.to_gpu(op_idx, np.int32), gpu.to_gpu(node_scales, float_type)
 
 def data_to_gpu(fmm_mat):
     src_tree_nodes = fmm_mat.src_tree.nodes
@@ -101,10 +116,17 @@ def data_to_gpu(fmm_mat):
             name = a + '2' + b
             gd[name] = getattr(gd['module'], name + '_' + K_name)
 
-    gd['obs_pts'] = gpu.to_gpu(fmm_mat.obs_tree.pts, float_type)
-    gd['obs_normals'] = gpu.to_gpu(fmm_mat.obs_tree.normals, float_type)
-    gd['src_pts'] = gpu.to_gpu(fmm_mat.src_tree.pts, float_type)
-    gd['src_normals'] = gpu.to_gpu(fmm_mat.src_tree.normals, float_type)
+    # The tree points are stored one coordinate at a time, but the gpu
+    # kernels expect them row by row.
+    to_gpu_rows = lambda arr: gpu.to_gpu(np.ascontiguousarray(arr), float_type)
+    gd['obs_pts'] = to_gpu_rows(fmm_mat.obs_tree.pts)
+    gd['obs_normals'] = to_gpu_rows(fmm_mat.obs_tree.normals)
+    if fmm_mat.self_interaction:
+        gd['src_pts'] = gd['obs_pts']
+        gd['src_normals'] = gd['obs_normals']
+    else:
+        gd['src_pts'] = to_gpu_rows(fmm_mat.src_tree.pts)
+        gd['src_normals'] = to_gpu_rows(fmm_mat.src_tree.normals)
 
     gd['tensor_dim'] = fmm_mat.cfg.tensor_dim
     gd['n_surf_pts'] = np.int32(surf.shape[0])
@@ -133,14 +155,18 @@ def data_to_gpu(fmm_mat):
     gd['u2e_node_n_idx'] = [
         gpu.to_gpu(fmm_mat.u2e[level].src_n_idx, np.int32) for level in range(n_src_levels)
     ]
-    gd['u2e_node_depth'] = gpu.to_gpu(np.array([n.depth for n in src_tree_nodes]), np.int32)
+    gd['u2e_node_op'], gd['u2e_node_scale'] = c2e_node_data(
+        fmm_mat, src_tree_nodes, fmm_mat.u2e_scales
+    )
     gd['u2e_ops'] = gpu.to_gpu(fmm_mat.u2e_ops, float_type)
 
     n_obs_levels = len(fmm_mat.l2l)
     gd['d2e_node_n_idx'] = [
         gpu.to_gpu(fmm_mat.d2e[level].src_n_idx, np.int32) for level in range(n_obs_levels)
     ]
-    gd['d2e_node_depth'] = gpu.to_gpu(np.array([n.depth for n in obs_tree_nodes]), np.int32)
+    gd['d2e_node_op'], gd['d2e_node_scale'] = c2e_node_data(
+        fmm_mat, obs_tree_nodes, fmm_mat.d2e_scales
+    )
     gd['d2e_ops'] = gpu.to_gpu(fmm_mat.d2e_ops, float_type)
 
     gd['dry_run'] = True
@@ -270,9 +296,10 @@ def gpu_d2e(fmm_mat, gd, level, evs):
             gd['locals'].data, gd['l_check'].data,
             np.int32(n_d2e), np.int32(n_d2e_rows),
             gd['d2e_node_n_idx'][level].data,
-            gd['d2e_node_depth'].data,
+            gd['d2e_node_op'].data,
+            gd['d2e_node_scale'].data,
             gd['d2e_ops'].data,
-            wait_for = evs
+            wait_for = [ev for ev in evs if ev is not None]
         )
     else:
         return None
@@ -289,9 +316,10 @@ def gpu_u2e(fmm_mat, gd, level, m2m_ev):
             gd['multipoles'].data, gd['m_check'].data,
             np.int32(n_u2e), np.int32(n_u2e_rows),
             gd['u2e_node_n_idx'][level].data,
-            gd['u2e_node_depth'].data,
+            gd['u2e_node_op'].data,
+            gd['u2e_node_scale'].data,
             gd['u2e_ops'].data,
-            wait_for = [m2m_ev]
+            wait_for = [] if m2m_ev is None else [m2m_ev]
         )
     else:
         return None
@@ -377,35 +405,4 @@ def eval_ocl(fmm_mat, input_vals, gpu_data = None, should_print_timing = True):
     return retval
 
 def eval_cpu(fmm_mat, input_vals):
-    tensor_dim = fmm_mat.cfg.tensor_dim
-    n_out = fmm_mat.obs_tree.pts.shape[0] * tensor_dim
-    n_multipoles = fmm_mat.src_tree.n_nodes * len(fmm_mat.surf) * tensor_dim
-    n_locals = fmm_mat.obs_tree.n_nodes * len(fmm_mat.surf) * tensor_dim
-
-    out = np.zeros(n_out)
-    m_check = np.zeros(n_multipoles)
-    multipoles = np.zeros(n_multipoles)
-    l_check = np.zeros(n_locals)
-    locals = np.zeros(n_locals)
-
-    fmm_mat.p2m_eval(m_check, input_vals)
-    fmm_mat.u2e_eval(multipoles, m_check, 0)
-
-    for i in range(1, len(fmm_mat.m2m)):
-        fmm_mat.m2m_eval(m_check, multipoles, i)
-        fmm_mat.u2e_eval(multipoles, m_check, i)
-
-    fmm_mat.p2l_eval(l_check, input_vals)
-    fmm_mat.m2l_eval(l_check, multipoles)
-    fmm_mat.d2e_eval(locals, l_check, 0)
-
-    for i in range(1, len(fmm_mat.l2l)):
-        fmm_mat.l2l_eval(l_check, locals, i)
-        fmm_mat.d2e_eval(locals, l_check, i)
-
-    fmm_mat.l2p_eval(out, locals)
-
-    fmm_mat.p2p_eval(out, input_vals)
-    fmm_mat.m2p_eval(out, multipoles)
-
-    return out
+    return fmm_mat.eval(input_vals)
@@ -1,6 +1,8 @@
 #pragma once
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <vector>
 
 template <size_t dim>
 inline double dot(const std::array<double,dim>& a, const std::array<double,dim>& b) {
@@ -30,6 +32,49 @@ inline double dist(const std::array<double,dim>& a, const std::array<double,dim>
     return hypot(sub(a,b));
 }
 
+// Points stored one coordinate at a time, all the x coordinates followed by
+// all the y coordinates and so on, so that kernels can load consecutive
+// points with unit stride.
+template <size_t dim>
+struct SoAPts {
+    size_t n;
+    std::vector<double> xs;
+
+    SoAPts(): n(0) {}
+    explicit SoAPts(size_t n): n(n), xs(dim * n) {}
+    SoAPts(const std::array<double,dim>* pts, size_t n): SoAPts(n) {
+        for (size_t i = 0; i < n; i++) {
+            set(i, pts[i]);
+        }
+    }
+    SoAPts(const std::vector<std::array<double,dim>>& pts): SoAPts(pts.data(), pts.size()) {}
+
+    size_t size() const { return n; }
+
+    std::array<double,dim> operator[](size_t i) const {
+        std::array<double,dim> out;
+        for (size_t d = 0; d < dim; d++) {
+            out[d] = xs[d * n + i];
+        }
+        return out;
+    }
+
+    void set(size_t i, const std::array<double,dim>& pt) {
+        for (size_t d = 0; d < dim; d++) {
+            xs[d * n + i] = pt[d];
+        }
+    }
+
+    // Pointers to each coordinate of the points from index start onwards.
+    std::array<const double*,dim> view(size_t start = 0) const {
+        std::array<const double*,dim> out;
+        for (size_t d = 0; d < dim; d++) {
+            out[d] = xs.data() + d * n + start;
+        }
+        return out;
+    }
+};
+
 template <size_t dim>
 struct Cube {
     std::array<double,dim> center;
@@ -42,6 +87,51 @@ struct Cube {
     }
 };
 
+// The cube centered on the points' bounding box. With spherical bounds, the
+// width is chosen so that R() is the radius of the smallest sphere around
+// that center holding the points, rather than so that the cube holds them.
+template <size_t dim>
+Cube<dim> tight_bounds(const std::array<const double*,dim>& pts, size_t n_pts, bool spherical) {
+    if (n_pts == 0) {
+        return {{}, 0.0};
+    }
+
+    std::array<double,dim> center;
+    for (size_t d = 0; d < dim; d++) {
+        auto minmax = std::minmax_element(pts[d], pts[d] + n_pts);
+        center[d] = (*minmax.first + *minmax.second) / 2;
+    }
+    double width = 0.0;
+    for (size_t i = 0; i < n_pts; i++) {
+        double r2 = 0.0;
+        for (size_t d = 0; d < dim; d++) {
+            double sep = fabs(pts[d][i] - center[d]);
+            if (spherical) {
+                r2 += sep * sep;
+            } else {
+                width = std::max(width, sep);
+            }
+        }
+        if (spherical) {
+            width = std::max(width, std::sqrt(r2));
+        }
+    }
+    if (spherical) {
+        width /= std::sqrt(static_cast<double>(dim));
+    }
+    return {center, width};
+}
+
+// The largest level in [min_level, max_level] for which
+// root_width / 2^level is still at least width.
+inline int fit_level(double root_width, double width, int min_level, int max_level) {
+    int level = min_level;
+    while (level < max_level && root_width / std::pow(2.0, level + 1) >= width) {
+        level++;
+    }
+    return level;
+}
+
 template <size_t dim>
 std::array<size_t,dim> make_child_idx(size_t i) 
 {
@@ -79,6 +169,18 @@ int find_containing_subcell(const Cube<dim>& b, const std::array<double,dim>& pt
     return child_idx;
 }
 
+// The subcell of parent that child is exactly, or -1 if child is not one of
+// parent's subcells.
+template <size_t dim>
+int child_octant(const Cube<dim>& parent, const Cube<dim>& child) {
+    int octant = find_containing_subcell(parent, child.center);
+    auto subcell = get_subcell(parent, make_child_idx<dim>(octant));
+    if (subcell.width != child.width || subcell.center != child.center) {
+        return -1;
+    }
+    return octant;
+}
+
 template <size_t dim>
 bool in_box(const Cube<dim>& b, const std::array<double,dim>& pt) {
     for (size_t d = 0; d < dim; d++) {
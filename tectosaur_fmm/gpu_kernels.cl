@@ -225,19 +225,20 @@ ${fmm_op("s2p", "pts", "surf", False)}
 
 __kernel
 void c2e_kernel(__global Real* out, __global Real* in,
-        int n_blocks, int n_rows, __global int* node_idx, __global int* node_depth,
-        __global Real* ops)
+        int n_blocks, int n_rows, __global int* node_idx, __global int* node_op,
+        __global Real* node_scale, __global Real* ops)
 {
     ${get_block_idx()}
 
     int n_idx = node_idx[block_idx];
-    __global Real* op_start = &ops[node_depth[n_idx] * n_rows * n_rows];
+    __global Real* op_start = &ops[node_op[n_idx] * n_rows * n_rows];
+    Real scale = node_scale[n_idx];
 
     for (int i = worker_idx; i < n_rows; i += ${n_workers_per_block}) {
         Real sum = 0.0;
         for (int j = 0; j < n_rows; j++) {
             sum += op_start[i * n_rows + j] * in[n_idx * n_rows + j];
         }
-        out[n_idx * n_rows + i] += sum;
+        out[n_idx * n_rows + i] += scale * sum;
     }
 }
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "kdtree.hpp"
+
+template <size_t dim>
+KDTree<dim>::KDTree(std::array<double,dim>* in_pts, std::array<double,dim>* in_normals,
+            size_t n_pts, size_t n_per_cell, bool spherical_bounds):
+    pts(n_pts),
+    normals(n_pts),
+    orig_idxs(n_pts),
+    n_pts(n_pts),
+    spherical_bounds(spherical_bounds)
+{
+    if (n_pts > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("too many points for 32 bit kdtree indices");
+    }
+
+    auto pts_normals = combine_pts_normals(in_pts, in_normals, n_pts);
+
+    build_nodes(n_per_cell, pts_normals);
+
+    max_height = nodes[0].height;
+
+#pragma omp parallel for
+    for (size_t i = 0; i < n_pts; i++) {
+        pts.set(i, pts_normals[i].pt);
+        normals.set(i, pts_normals[i].normal);
+        orig_idxs[i] = pts_normals[i].orig_idx;
+    }
+
+    fit_node_bounds();
+}
+
+template <size_t dim>
+void KDTree<dim>::build_nodes(size_t n_per_cell, std::vector<PtNormal<dim>>& temp_pts) {
+    // Like the Octree, the nodes are built breadth-first and stored level by
+    // level.
+    nodes.push_back({Cube<dim>({}, 0.0), 0, uint32_t(n_pts), 0, 0, 0, 0, 0, false});
+    for (size_t n_idx = 0; n_idx < nodes.size(); n_idx++) {
+        auto n = nodes[n_idx];
+        if (n.depth + 1 > int(level_starts.size())) {
+            level_starts.push_back(n_idx);
+        }
+
+        // Splitting a single point would leave it alone in one of the children.
+        bool is_leaf = n.end - n.start <= std::max<size_t>(n_per_cell, 1);
+        nodes[n_idx].idx = n_idx;
+        nodes[n_idx].is_leaf = is_leaf;
+        if (is_leaf) {
+            continue;
+        }
+
+        auto min_pt = temp_pts[n.start].pt;
+        auto max_pt = temp_pts[n.start].pt;
+        for (size_t i = n.start; i < n.end; i++) {
+            for (size_t d = 0; d < dim; d++) {
+                min_pt[d] = std::min(min_pt[d], temp_pts[i].pt[d]);
+                max_pt[d] = std::max(max_pt[d], temp_pts[i].pt[d]);
+            }
+        }
+        size_t split_d = 0;
+        for (size_t d = 1; d < dim; d++) {
+            if (max_pt[d] - min_pt[d] > max_pt[split_d] - min_pt[split_d]) {
+                split_d = d;
+            }
+        }
+
+        uint32_t mid = n.start + (n.end - n.start) / 2;
+        std::nth_element(
+            temp_pts.begin() + n.start, temp_pts.begin() + mid, temp_pts.begin() + n.end,
+            [&] (const PtNormal<dim>& a, const PtNormal<dim>& b) {
+                return a.pt[split_d] < b.pt[split_d];
+            }
+        );
+
+        nodes[n_idx].first_child = nodes.size();
+        nodes.push_back({n.bounds, n.start, mid, 0, 0, 0, n.depth + 1, 0, false});
+        nodes.push_back({n.bounds, mid, n.end, 0, 0, 0, n.depth + 1, 0, false});
+    }
+    level_starts.push_back(nodes.size());
+
+    for (size_t i = nodes.size(); i > 0; i--) {
+        auto& n = nodes[i - 1];
+        for (auto child_idx: n.children()) {
+            n.height = std::max(n.height, nodes[child_idx].height + 1);
+        }
+    }
+}
+
+template <size_t dim>
+bool KDTree<dim>::refit(const std::array<double,dim>* in_pts,
+    const std::array<double,dim>* in_normals)
+{
+#pragma omp parallel for
+    for (size_t i = 0; i < n_pts; i++) {
+        pts.set(i, in_pts[orig_idxs[i]]);
+        normals.set(i, in_normals[orig_idxs[i]]);
+    }
+    fit_node_bounds();
+    return true;
+}
+
+template <size_t dim>
+void KDTree<dim>::fit_node_bounds() {
+    double root_width = tight_bounds(pts.view(), n_pts, spherical_bounds).width;
+#pragma omp parallel for
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto& n = nodes[i];
+        auto tight = tight_bounds(pts.view(n.start), n.end - n.start, spherical_bounds);
+        int level = fit_level(root_width, tight.width, 0, max_height);
+        n.bounds = {tight.center, root_width / std::pow(2.0, level)};
+        n.bounds_level = level;
+    }
+}
+
+template struct KDTree<2>;
+template struct KDTree<3>;
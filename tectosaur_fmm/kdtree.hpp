@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include "geometry.hpp"
+#include "octree.hpp"
+
+template <size_t dim>
+struct KDNode {
+    static const size_t split = 2;
+
+    Cube<dim> bounds;
+    uint32_t start;
+    uint32_t end;
+    uint32_t idx;
+    uint32_t first_child;
+    int height;
+    int depth;
+    int bounds_level;
+    bool is_leaf;
+
+    ChildRange children() const {
+        return {first_child, first_child + (is_leaf ? 0 : uint32_t(split))};
+    }
+};
+
+// A binary tree that splits each node at the median along the dimension in
+// which its points are most spread out. The node bounds fit the points and
+// have widths of root_width / 2^bounds_level, like adaptive Octree bounds.
+template <size_t dim>
+struct KDTree {
+    typedef KDNode<dim> Node;
+    static const size_t spatial_dim = dim;
+
+    SoAPts<dim> pts;
+    SoAPts<dim> normals;
+    std::vector<size_t> orig_idxs;
+
+    size_t n_pts;
+    int max_height;
+    bool spherical_bounds;
+    std::vector<KDNode<dim>> nodes;
+    std::vector<size_t> level_starts;
+
+    const KDNode<dim>& root() const { return nodes.front(); }
+
+    double level_width(int bounds_level) const {
+        return root().bounds.width * std::pow(2.0, root().bounds_level - bounds_level);
+    }
+
+    KDTree(std::array<double,dim>* in_pts, std::array<double,dim>* in_normals,
+            size_t n_pts, size_t n_per_cell, bool spherical_bounds = false);
+
+    void build_nodes(size_t n_per_cell, std::vector<PtNormal<dim>>& temp_pts);
+
+    // Move the points, given in their original order. Every point stays in
+    // its leaf and only the node bounds are refit, so the splits drift away
+    // from the medians as the points move. Always succeeds.
+    bool refit(const std::array<double,dim>* in_pts,
+        const std::array<double,dim>* in_normals);
+
+    void fit_node_bounds();
+};
@@ -1,23 +1,186 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <omp.h>
 #include "octree.hpp"
 
+// Spread the bits of a cell index so that there are dim - 1 zero bits
+// between each pair of consecutive bits.
+template <size_t dim>
+uint64_t spread_bits(uint64_t x);
+
+template <>
+uint64_t spread_bits<2>(uint64_t x) {
+    x &= 0xffffffff;
+    x = (x | (x << 16)) & 0x0000ffff0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+    x = (x | (x << 2)) & 0x3333333333333333;
+    x = (x | (x << 1)) & 0x5555555555555555;
+    return x;
+}
+
+template <>
+uint64_t spread_bits<3>(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffff;
+    x = (x | (x << 16)) & 0x001f0000ff0000ff;
+    x = (x | (x << 8)) & 0x100f00f00f00f00f;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+    x = (x | (x << 2)) & 0x1249249249249249;
+    return x;
+}
+
+template <size_t dim>
+std::vector<uint64_t> morton_keys(const Cube<dim>& bounds,
+        const std::array<double,dim>* pts, size_t n_pts)
+{
+    const int n_levels = morton_levels<dim>();
+    const double n_cells = std::pow(2.0, n_levels);
+    const int64_t max_cell = static_cast<int64_t>(n_cells) - 1;
+
+    std::vector<uint64_t> keys(n_pts);
+#pragma omp parallel for
+    for (size_t i = 0; i < n_pts; i++) {
+        // A point that lies exactly on a cell boundary belongs to the lower
+        // cell, matching the strict comparison in find_containing_subcell.
+        // Interleaving the cell index bits makes each group of dim bits,
+        // starting from the most significant, the child index at that level.
+        uint64_t key = 0;
+        for (size_t d = 0; d < dim; d++) {
+            double lower = bounds.center[d] - bounds.width;
+            double scaled = 0.0;
+            if (bounds.width > 0) {
+                scaled = (pts[i][d] - lower) / (2 * bounds.width) * n_cells;
+            }
+            auto cell = static_cast<int64_t>(std::ceil(scaled)) - 1;
+            cell = std::min(std::max(cell, int64_t(0)), max_cell);
+            key |= spread_bits<dim>(cell) << (dim - 1 - d);
+        }
+        keys[i] = key;
+    }
+    return keys;
+}
+
+// Stable least significant digit radix sort. The keys are sorted in place and
+// the returned vector holds the original index of each sorted key.
+std::vector<size_t> radix_sort(std::vector<uint64_t>& keys) {
+    const int radix_bits = 11;
+    const size_t n_buckets = 1 << radix_bits;
+
+    size_t n = keys.size();
+    std::vector<size_t> idxs(n);
+#pragma omp parallel for
+    for (size_t i = 0; i < n; i++) {
+        idxs[i] = i;
+    }
+
+    std::vector<uint64_t> keys_buf(n);
+    std::vector<size_t> idxs_buf(n);
+    std::vector<size_t> offsets;
+    for (int shift = 0; shift < 64; shift += radix_bits) {
+        bool skip_digit = false;
+#pragma omp parallel
+        {
+            int n_threads = omp_get_num_threads();
+            int thread = omp_get_thread_num();
+            size_t chunk_start = n * thread / n_threads;
+            size_t chunk_end = n * (thread + 1) / n_threads;
+
+#pragma omp single
+            offsets.assign(n_threads * n_buckets, 0);
+
+            size_t* thread_offsets = &offsets[thread * n_buckets];
+            for (size_t i = chunk_start; i < chunk_end; i++) {
+                thread_offsets[(keys[i] >> shift) & (n_buckets - 1)]++;
+            }
+
+#pragma omp barrier
+#pragma omp single
+            {
+                // Each thread scatters its chunk into its own slice of every
+                // bucket, so the slices are laid out bucket-major.
+                size_t total = 0;
+                for (size_t b = 0; b < n_buckets; b++) {
+                    size_t bucket_start = total;
+                    for (int t = 0; t < n_threads; t++) {
+                        auto count = offsets[t * n_buckets + b];
+                        offsets[t * n_buckets + b] = total;
+                        total += count;
+                    }
+                    // Nothing to do if every key has the same digit.
+                    if (total - bucket_start == n) {
+                        skip_digit = true;
+                    }
+                }
+            }
+
+            if (!skip_digit) {
+                for (size_t i = chunk_start; i < chunk_end; i++) {
+                    auto dest = thread_offsets[(keys[i] >> shift) & (n_buckets - 1)]++;
+                    keys_buf[dest] = keys[i];
+                    idxs_buf[dest] = idxs[i];
+                }
+            }
+        }
+
+        if (!skip_digit) {
+            keys.swap(keys_buf);
+            idxs.swap(idxs_buf);
+        }
+    }
+    return idxs;
+}
+
+template <size_t dim>
+std::array<int,OctreeNode<dim>::split+1> morton_partition(
+        const uint64_t* start, const uint64_t* end, int depth)
+{
+    // The keys are sorted and share every digit above this depth, so the
+    // children are contiguous runs of the digit at this depth.
+    int shift = dim * (morton_levels<dim>() - 1 - depth);
+    std::array<int,OctreeNode<dim>::split+1> splits{};
+    auto* child_start = start;
+    for (size_t octant = 0; octant < OctreeNode<dim>::split; octant++) {
+        child_start = std::partition_point(child_start, end,
+            [&] (uint64_t key) {
+                return ((key >> shift) & (OctreeNode<dim>::split - 1)) <= octant;
+            }
+        );
+        splits[octant + 1] = child_start - start;
+    }
+    return splits;
+}
+
 template <size_t dim>
 std::array<int,OctreeNode<dim>::split+1> octree_partition(
         const Cube<dim>& bounds, PtNormal<dim>* start, PtNormal<dim>* end) 
 {
-    std::array<std::vector<PtNormal<dim>>,OctreeNode<dim>::split> chunks{};
+    const size_t split = OctreeNode<dim>::split;
+
+    std::array<int,split+1> splits{};
     for (auto* entry = start; entry < end; entry++) {
-        chunks[find_containing_subcell(bounds, entry->pt)].push_back(*entry);
+        splits[find_containing_subcell(bounds, entry->pt) + 1]++;
+    }
+    for (size_t subcell_idx = 0; subcell_idx < split; subcell_idx++) {
+        splits[subcell_idx + 1] += splits[subcell_idx];
     }
 
-    auto* next = start;
-    std::array<int,OctreeNode<dim>::split+1> splits{};
-    for (size_t subcell_idx = 0; subcell_idx < OctreeNode<dim>::split; subcell_idx++) {
-        size_t subcell_n_pts = chunks[subcell_idx].size();
-        for (size_t i = 0; i < subcell_n_pts; i++) {
-            *next = chunks[subcell_idx][i];
-            next++;
+    // Swap each misplaced point into the next free slot of its own subcell
+    // until every subcell's range is filled.
+    std::array<int,split> next;
+    std::copy(splits.begin(), splits.end() - 1, next.begin());
+    for (size_t subcell_idx = 0; subcell_idx < split; subcell_idx++) {
+        while (next[subcell_idx] < splits[subcell_idx + 1]) {
+            auto& entry = start[next[subcell_idx]];
+            size_t dest = find_containing_subcell(bounds, entry.pt);
+            if (dest == subcell_idx) {
+                next[subcell_idx]++;
+            } else {
+                std::swap(entry, start[next[dest]]);
+                next[dest]++;
+            }
         }
-        splits[subcell_idx + 1] = splits[subcell_idx] + subcell_n_pts;
     }
 
     return splits;
@@ -34,12 +197,12 @@ std::vector<PtNormal<dim>> combine_pts_normals(std::array<double,dim>* pts,
     return pts_normals;
 }
 
-template <size_t dim>
-Cube<dim> bounding_box(PtNormal<dim>* pts, size_t n_pts) {
+template <size_t dim, typename F>
+Cube<dim> bounding_box_impl(size_t n_pts, const F& get_pt) {
     std::array<double,dim> center_of_mass{};
     for (size_t i = 0; i < n_pts; i++) {
         for (size_t d = 0; d < dim; d++) {
-            center_of_mass[d] += pts[i].pt[d];
+            center_of_mass[d] += get_pt(i)[d];
         }
     }
     for (size_t d = 0; d < dim; d++) {
@@ -49,68 +212,322 @@ Cube<dim> bounding_box(PtNormal<dim>* pts, size_t n_pts) {
     double max_width = 0.0;
     for (size_t i = 0; i < n_pts; i++) {
         for (size_t d = 0; d < dim; d++) {
-            max_width = std::max(max_width, fabs(pts[i].pt[d] - center_of_mass[d]));
+            max_width = std::max(max_width, fabs(get_pt(i)[d] - center_of_mass[d]));
         }
     }
 
     return {center_of_mass, max_width};
 }
 
+template <size_t dim>
+Cube<dim> bounding_box(PtNormal<dim>* pts, size_t n_pts) {
+    return bounding_box_impl<dim>(n_pts, [&] (size_t i) { return pts[i].pt; });
+}
+
+template <size_t dim>
+Cube<dim> bounding_box(const std::array<double,dim>* pts, size_t n_pts) {
+    return bounding_box_impl<dim>(n_pts, [&] (size_t i) { return pts[i]; });
+}
+
 
 template <size_t dim>
 Octree<dim>::Octree(std::array<double,dim>* in_pts, std::array<double,dim>* in_normals,
-            size_t n_pts, size_t n_per_cell):
+            size_t n_pts, size_t n_per_cell, bool morton, bool adaptive_bounds,
+            int max_depth):
     pts(n_pts),
     normals(n_pts),
     orig_idxs(n_pts),
-    n_pts(n_pts)
+    n_pts(n_pts),
+    root_cell(bounding_box(in_pts, n_pts)),
+    adaptive_bounds(adaptive_bounds)
 {
-    auto pts_normals = combine_pts_normals(in_pts, in_normals, n_pts);
+    if (n_pts > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("too many points for 32 bit octree indices");
+    }
+
+    // Sorting the points by Morton key puts every node's points in a
+    // contiguous range, so the hierarchy can be read off the sorted keys.
+    // Without keys, every node is partitioned geometrically.
+    std::vector<uint64_t> keys;
+    std::vector<PtNormal<dim>> pts_normals(n_pts);
+    if (morton) {
+        keys = morton_keys(root_cell, in_pts, n_pts);
+        auto sorted_idxs = radix_sort(keys);
+#pragma omp parallel for
+        for (size_t i = 0; i < n_pts; i++) {
+            auto orig_idx = sorted_idxs[i];
+            pts_normals[i] = {in_pts[orig_idx], in_normals[orig_idx], orig_idx};
+        }
+    } else {
+        pts_normals = combine_pts_normals(in_pts, in_normals, n_pts);
+    }
 
-    auto bounds = bounding_box(pts_normals.data(), n_pts);
-    add_node(0, n_pts, n_per_cell, 0, bounds, pts_normals);
+    build_nodes(n_per_cell, max_depth, root_cell, pts_normals, keys);
 
     max_height = nodes[0].height;
 
+    // Within a leaf, keep the points in their input order.
+#pragma omp parallel for
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i].is_leaf) {
+            continue;
+        }
+        std::sort(
+            pts_normals.begin() + nodes[i].start, pts_normals.begin() + nodes[i].end,
+            [] (const PtNormal<dim>& a, const PtNormal<dim>& b) {
+                return a.orig_idx < b.orig_idx;
+            }
+        );
+    }
+
+#pragma omp parallel for
     for (size_t i = 0; i < n_pts; i++) {
-        pts[i] = pts_normals[i].pt;
-        normals[i] = pts_normals[i].normal;
+        pts.set(i, pts_normals[i].pt);
+        normals.set(i, pts_normals[i].normal);
         orig_idxs[i] = pts_normals[i].orig_idx;
     }
+
+    if (adaptive_bounds) {
+        shrink_bounds();
+    }
+}
+
+template <size_t dim>
+void Octree<dim>::shrink_bounds() {
+    double root_width = root().bounds.width;
+#pragma omp parallel for
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto& n = nodes[i];
+        if (n.start == n.end) {
+            continue;
+        }
+
+        // Widths stay on the root_width / 2^level ladder so that all the nodes
+        // with the same bounds_level share their u2e and d2e operators. No
+        // node gets narrower than the deepest geometric level.
+        auto tight = tight_bounds(pts.view(n.start), n.end - n.start, false);
+        int level = fit_level(root_width, tight.width, n.depth, max_height);
+
+        // At the same width, moving the center onto the points doesn't make
+        // the node any smaller, but does change which pairs are separated,
+        // sometimes for the worse, so the geometric cell is kept.
+        if (level == n.depth) {
+            continue;
+        }
+        n.bounds = {tight.center, root_width / std::pow(2.0, level)};
+        n.bounds_level = level;
+    }
+}
+
+template <size_t dim>
+std::vector<Cube<dim>> Octree<dim>::cells() const {
+    std::vector<Cube<dim>> out(nodes.size(), root_cell);
+    for (auto& n: nodes) {
+        for (auto child_idx: n.children()) {
+            out[child_idx] = get_subcell(
+                out[n.idx], make_child_idx<dim>(child_idx - n.first_child)
+            );
+        }
+    }
+    return out;
+}
+
+template <size_t dim>
+bool Octree<dim>::refit(const std::array<double,dim>* in_pts,
+    const std::array<double,dim>* in_normals)
+{
+    auto node_cells = cells();
+
+    std::vector<uint32_t> old_leaf(n_pts);
+#pragma omp parallel for
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].is_leaf) {
+            std::fill(&old_leaf[nodes[i].start], &old_leaf[nodes[i].end], nodes[i].idx);
+        }
+    }
+
+    // Points on a cell boundary could belong to either side, so a point only
+    // changes leaves once it is outside its old cell.
+    std::vector<uint32_t> new_leaf(n_pts);
+    bool in_root = true;
+    size_t n_moved = 0;
+#pragma omp parallel for reduction(&&:in_root) reduction(+:n_moved)
+    for (size_t i = 0; i < n_pts; i++) {
+        auto& pt = in_pts[orig_idxs[i]];
+        new_leaf[i] = old_leaf[i];
+        if (in_box(node_cells[old_leaf[i]], pt)) {
+            continue;
+        }
+        if (!in_box(root_cell, pt)) {
+            in_root = false;
+            continue;
+        }
+        uint32_t n_idx = 0;
+        while (!nodes[n_idx].is_leaf) {
+            n_idx = nodes[n_idx].first_child + find_containing_subcell(node_cells[n_idx], pt);
+        }
+        new_leaf[i] = n_idx;
+        n_moved += new_leaf[i] != old_leaf[i];
+    }
+    if (!in_root) {
+        return false;
+    }
+
+    if (n_moved > 0) {
+        // Recount the points in every node and hand out the point ranges
+        // again, in the same order as the original build.
+        std::vector<uint32_t> counts(nodes.size(), 0);
+        for (size_t i = 0; i < n_pts; i++) {
+            counts[new_leaf[i]]++;
+        }
+        for (size_t i = nodes.size(); i > 0; i--) {
+            for (auto child_idx: nodes[i - 1].children()) {
+                counts[i - 1] += counts[child_idx];
+            }
+        }
+        for (auto& n: nodes) {
+            auto start = n.start;
+            for (auto child_idx: n.children()) {
+                nodes[child_idx].start = start;
+                start += counts[child_idx];
+                nodes[child_idx].end = start;
+            }
+        }
+
+        std::vector<uint32_t> next(nodes.size());
+        std::vector<bool> gained_pts(nodes.size(), false);
+        for (auto& n: nodes) {
+            next[n.idx] = n.start;
+        }
+        std::vector<size_t> new_orig_idxs(n_pts);
+        for (size_t i = 0; i < n_pts; i++) {
+            new_orig_idxs[next[new_leaf[i]]++] = orig_idxs[i];
+            if (new_leaf[i] != old_leaf[i]) {
+                gained_pts[new_leaf[i]] = true;
+            }
+        }
+        orig_idxs = std::move(new_orig_idxs);
+
+        // The points that stayed are still in input order, so only the
+        // leaves that gained points need sorting.
+#pragma omp parallel for
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (gained_pts[i]) {
+                std::sort(
+                    orig_idxs.begin() + nodes[i].start, orig_idxs.begin() + nodes[i].end
+                );
+            }
+        }
+    }
+
+#pragma omp parallel for
+    for (size_t i = 0; i < n_pts; i++) {
+        pts.set(i, in_pts[orig_idxs[i]]);
+        normals.set(i, in_normals[orig_idxs[i]]);
+    }
+
+    if (adaptive_bounds) {
+        for (auto& n: nodes) {
+            n.bounds = node_cells[n.idx];
+            n.bounds_level = n.depth;
+        }
+        shrink_bounds();
+    }
+    return true;
+}
+
+template <size_t dim>
+bool all_coincident(const PtNormal<dim>* pts, size_t n_pts) {
+    for (size_t i = 1; i < n_pts; i++) {
+        if (pts[i].pt != pts[0].pt) {
+            return false;
+        }
+    }
+    return true;
 }
 
 template <size_t dim>
-size_t Octree<dim>::add_node(size_t start, size_t end, 
-    size_t n_per_cell, int depth, Cube<dim> bounds,
-    std::vector<PtNormal<dim>>& temp_pts)
+void Octree<dim>::build_nodes(size_t n_per_cell, int max_depth, Cube<dim> bounds,
+    std::vector<PtNormal<dim>>& temp_pts, const std::vector<uint64_t>& keys)
 {
-    bool is_leaf = end - start <= n_per_cell; 
-    auto n_idx = nodes.size();
-    nodes.push_back({start, end, bounds, is_leaf, 0, depth, n_idx, {}});
-    if (!is_leaf) {
-        auto splits = octree_partition(bounds, temp_pts.data() + start, temp_pts.data() + end);
-        int max_child_height = 0;
+    // The nodes vector doubles as the breadth-first queue. Children are
+    // appended as a block when their parent is split, so each level ends up
+    // contiguous and after the level above it.
+    nodes.push_back({bounds, 0, uint32_t(n_pts), 0, 0, 0, 0, 0, false});
+    for (size_t n_idx = 0; n_idx < nodes.size(); n_idx++) {
+        auto n = nodes[n_idx];
+        if (n.depth + 1 > int(level_starts.size())) {
+            level_starts.push_back(n_idx);
+        }
+
+        bool is_leaf = n.end - n.start <= n_per_cell || n.depth >= max_depth;
+        std::array<int,OctreeNode<dim>::split+1> splits{};
+        if (!is_leaf) {
+            // Past the resolution of the Morton keys, all the keys in a node
+            // are equal and the points have to be partitioned geometrically.
+            auto* pts_start = temp_pts.data() + n.start;
+            auto* pts_end = temp_pts.data() + n.end;
+            if (!keys.empty() && n.depth < morton_levels<dim>()) {
+                splits = morton_partition<dim>(
+                    keys.data() + n.start, keys.data() + n.end, n.depth
+                );
+            } else {
+                splits = octree_partition(n.bounds, pts_start, pts_end);
+            }
+
+            // Coincident points can never be separated, so a node holding
+            // only copies of one point is a leaf however many it holds.
+            bool one_child = false;
+            for (size_t octant = 0; octant < OctreeNode<dim>::split; octant++) {
+                one_child |= uint32_t(splits[octant + 1] - splits[octant]) == n.end - n.start;
+            }
+            is_leaf = one_child && all_coincident(pts_start, n.end - n.start);
+        }
+
+        nodes[n_idx].idx = n_idx;
+        nodes[n_idx].is_leaf = is_leaf;
+        if (is_leaf) {
+            continue;
+        }
+
+        nodes[n_idx].first_child = nodes.size();
         for (size_t octant = 0; octant < OctreeNode<dim>::split; octant++) {
-            auto child_bounds = get_subcell(bounds, make_child_idx<dim>(octant));
-            auto child_start = start + splits[octant];
-            auto child_end = start + splits[octant + 1];
-            // TODO: Should we use adaptive bounds?
-            // auto child_n_pts = child_end - child_start;
-            // auto child_bounds = bounding_box(&temp_pts[child_start], child_n_pts);
-            auto child_node_idx = add_node(
-                child_start, child_end,
-                n_per_cell, depth + 1, child_bounds, temp_pts
-            );
-            nodes[n_idx].children[octant] = child_node_idx;
-            max_child_height = std::max(max_child_height, nodes[child_node_idx].height);
+            nodes.push_back({
+                get_subcell(n.bounds, make_child_idx<dim>(octant)),
+                n.start + splits[octant], n.start + splits[octant + 1],
+                0, 0, 0, n.depth + 1, n.depth + 1, false
+            });
+        }
+    }
+    level_starts.push_back(nodes.size());
+
+    for (size_t i = nodes.size(); i > 0; i--) {
+        auto& n = nodes[i - 1];
+        for (auto child_idx: n.children()) {
+            n.height = std::max(n.height, nodes[child_idx].height + 1);
         }
-        nodes[n_idx].height = max_child_height + 1;
     }
-    return n_idx;
 }
 
+template std::vector<uint64_t> morton_keys(const Cube<2>& bounds,
+        const std::array<double,2>* pts, size_t n_pts);
+template std::vector<uint64_t> morton_keys(const Cube<3>& bounds,
+        const std::array<double,3>* pts, size_t n_pts);
+
+template std::array<int,OctreeNode<2>::split+1> morton_partition<2>(
+        const uint64_t* start, const uint64_t* end, int depth);
+template std::array<int,OctreeNode<3>::split+1> morton_partition<3>(
+        const uint64_t* start, const uint64_t* end, int depth);
+
+template std::array<int,OctreeNode<2>::split+1> octree_partition(
+        const Cube<2>& bounds, PtNormal<2>* start, PtNormal<2>* end);
+template std::array<int,OctreeNode<3>::split+1> octree_partition(
+        const Cube<3>& bounds, PtNormal<3>* start, PtNormal<3>* end);
+
 template Cube<2> bounding_box(PtNormal<2>* pts, size_t n_pts);
 template Cube<3> bounding_box(PtNormal<3>* pts, size_t n_pts);
+template Cube<2> bounding_box(const std::array<double,2>* pts, size_t n_pts);
+template Cube<3> bounding_box(const std::array<double,3>* pts, size_t n_pts);
 
 template std::vector<PtNormal<2>> combine_pts_normals(std::array<double,2>* pts,
         std::array<double,2>* normals, size_t n_pts);
@@ -3,20 +3,48 @@
 #include <array>
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include "geometry.hpp"
 
+// The indices of a node's children, which are stored contiguously.
+struct ChildRange {
+    struct Iterator {
+        uint32_t idx;
+        uint32_t operator*() const { return idx; }
+        Iterator& operator++() { idx++; return *this; }
+        bool operator!=(const Iterator& other) const { return idx != other.idx; }
+    };
+
+    uint32_t first;
+    uint32_t last;
+
+    Iterator begin() const { return {first}; }
+    Iterator end() const { return {last}; }
+    size_t size() const { return last - first; }
+    uint32_t operator[](size_t i) const { return first + i; }
+};
+
+// Nodes are stored level by level, so a node's children are contiguous and
+// the point ranges and indices fit in 32 bits. In 3D, a node is 64 bytes.
 template <size_t dim>
 struct OctreeNode {
     static const size_t split = 2<<(dim-1);
 
-    size_t start;
-    size_t end;
     Cube<dim> bounds;
-    bool is_leaf;
+    uint32_t start;
+    uint32_t end;
+    uint32_t idx;
+    uint32_t first_child;
     int height;
     int depth;
-    size_t idx;
-    std::array<size_t,split> children;
+    // The bounds width is the root width halved bounds_level times. This
+    // equals depth unless the bounds have been shrunk to fit the points.
+    int bounds_level;
+    bool is_leaf;
+
+    ChildRange children() const {
+        return {first_child, first_child + (is_leaf ? 0 : uint32_t(split))};
+    }
 };
 
 template <size_t dim>
@@ -26,6 +54,20 @@ struct PtNormal {
     size_t orig_idx;
 };
 
+// The number of tree levels that fit in a 64 bit Morton key.
+template <size_t dim>
+constexpr int morton_levels() { return 64 / dim; }
+
+template <size_t dim>
+std::vector<uint64_t> morton_keys(const Cube<dim>& bounds,
+        const std::array<double,dim>* pts, size_t n_pts);
+
+std::vector<size_t> radix_sort(std::vector<uint64_t>& keys);
+
+template <size_t dim>
+std::array<int,OctreeNode<dim>::split+1> morton_partition(
+        const uint64_t* start, const uint64_t* end, int depth);
+
 template <size_t dim>
 std::array<int,OctreeNode<dim>::split+1> octree_partition(
         const Cube<dim>& bounds, PtNormal<dim>* start, PtNormal<dim>* end);
@@ -37,22 +79,56 @@ std::vector<PtNormal<dim>> combine_pts_normals(std::array<double,dim>* pts,
 template <size_t dim>
 Cube<dim> bounding_box(PtNormal<dim>* pts, size_t n_pts);
 
+template <size_t dim>
+Cube<dim> bounding_box(const std::array<double,dim>* pts, size_t n_pts);
+
 template <size_t dim>
 struct Octree {
-    std::vector<std::array<double,dim>> pts;
-    std::vector<std::array<double,dim>> normals;
+    typedef OctreeNode<dim> Node;
+    static const size_t spatial_dim = dim;
+    static const int default_max_depth = 30;
+
+    SoAPts<dim> pts;
+    SoAPts<dim> normals;
     std::vector<size_t> orig_idxs;
 
     size_t n_pts;
     int max_height;
+    // The root cell before any adaptive shrinking. Every node's cell is a
+    // subcell of it.
+    Cube<dim> root_cell;
+    bool adaptive_bounds;
     std::vector<OctreeNode<dim>> nodes;
+    // The nodes at depth d are nodes[level_starts[d]] to nodes[level_starts[d+1]].
+    std::vector<size_t> level_starts;
 
     const OctreeNode<dim>& root() const { return nodes.front(); }
 
+    double level_width(int bounds_level) const {
+        return root().bounds.width * std::pow(2.0, root().bounds_level - bounds_level);
+    }
+
     Octree(std::array<double,dim>* in_pts, std::array<double,dim>* in_normals,
-            size_t n_pts, size_t n_per_cell);
+            size_t n_pts, size_t n_per_cell, bool morton = true,
+            bool adaptive_bounds = false, int max_depth = default_max_depth);
 
-    size_t add_node(size_t start, size_t end, 
-        size_t n_per_cell, int depth, Cube<dim> bounds,
-        std::vector<PtNormal<dim>>& temp_pts);
+    void shrink_bounds();
+
+    // Move the points, given in their original order, without rebuilding the
+    // tree. Points that leave their leaf's cell are moved to the leaf whose
+    // cell now holds them, so leaves may end up with more than n_per_cell
+    // points or none at all. Returns false, leaving the tree untouched, if a
+    // point has left the root cell and the tree needs to be rebuilt.
+    bool refit(const std::array<double,dim>* in_pts,
+        const std::array<double,dim>* in_normals);
+
+    std::vector<Cube<dim>> cells() const;
+
+    // Leaves hold at most n_per_cell points unless they are at max_depth or
+    // all their points coincide.
+    void build_nodes(size_t n_per_cell, int max_depth, Cube<dim> bounds,
+        std::vector<PtNormal<dim>>& temp_pts, const std::vector<uint64_t>& keys);
 };
+
+template <size_t dim>
+const int Octree<dim>::default_max_depth;
@@ -0,0 +1,158 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "op_cache.hpp"
+
+// An operator file is the magic string, the key length, the key padded to a
+// multiple of 8 bytes, the number of values and then the values, so the
+// values of a mapped file are aligned.
+static const char magic[8] = {'t', 'f', 'm', 'm', 'o', 'p', '1', '\n'};
+
+static size_t padded(size_t n_bytes) {
+    return (n_bytes + 7) / 8 * 8;
+}
+
+DenseOp::DenseOp(std::vector<double> values) {
+    auto owned = std::make_shared<const std::vector<double>>(std::move(values));
+    ptr = owned->data();
+    n = owned->size();
+    storage = owned;
+}
+
+// Creates dir and any missing parents, like mkdir -p.
+static void make_dirs(const std::string& dir) {
+    for (size_t end = dir.find('/', 1); ; end = dir.find('/', end + 1)) {
+        auto part = dir.substr(0, end);
+        struct stat st;
+        if (mkdir(part.c_str(), 0777) != 0 && errno != EEXIST) {
+            throw std::runtime_error("can't create the operator cache directory " +
+                part + ": " + std::strerror(errno));
+        }
+        if (stat(part.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            throw std::runtime_error("the operator cache path " + part +
+                " is not a directory");
+        }
+        if (end == std::string::npos) {
+            return;
+        }
+    }
+}
+
+OpCache::OpCache(std::string dir):
+    dir(std::move(dir))
+{
+    if (enabled()) {
+        make_dirs(this->dir);
+    }
+}
+
+std::string OpCache::path(const std::string& key) const {
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c: key) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.op", static_cast<unsigned long long>(hash));
+    return dir + "/" + name;
+}
+
+DenseOp OpCache::get(const std::string& key,
+    const std::function<std::vector<double>()>& build) const
+{
+    if (!enabled()) {
+        return DenseOp(build());
+    }
+    auto op = load(key);
+    if (op.data() != nullptr) {
+        return op;
+    }
+    auto values = build();
+    store(key, values);
+    return DenseOp(std::move(values));
+}
+
+// Returns an empty operator if the file is missing, truncated or holds a
+// different key with the same hash.
+DenseOp OpCache::load(const std::string& key) const {
+    int fd = open(path(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return DenseOp();
+    }
+    struct stat st;
+    size_t n_bytes = 0;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        n_bytes = st.st_size;
+        map = mmap(nullptr, n_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return DenseOp();
+    }
+    std::shared_ptr<const void> storage(map,
+        [=] (const void* p) { munmap(const_cast<void*>(p), n_bytes); });
+
+    auto* bytes = static_cast<const char*>(map);
+    size_t values_start = 2 * sizeof(uint64_t) + padded(key.size()) + sizeof(uint64_t);
+    if (n_bytes < values_start || std::memcmp(bytes, magic, sizeof(magic)) != 0) {
+        return DenseOp();
+    }
+    uint64_t key_size;
+    std::memcpy(&key_size, bytes + sizeof(magic), sizeof(key_size));
+    const char* file_key = bytes + 2 * sizeof(uint64_t);
+    if (key_size != key.size() || std::memcmp(file_key, key.data(), key.size()) != 0) {
+        return DenseOp();
+    }
+    uint64_t n;
+    std::memcpy(&n, bytes + values_start - sizeof(uint64_t), sizeof(n));
+    if (n_bytes != values_start + n * sizeof(double)) {
+        return DenseOp();
+    }
+
+    DenseOp op;
+    op.storage = storage;
+    op.ptr = reinterpret_cast<const double*>(bytes + values_start);
+    op.n = n;
+    op.is_mapped = true;
+    return op;
+}
+
+// The file is written under a temporary name and renamed into place, so
+// readers never see a partial operator.
+void OpCache::store(const std::string& key, const std::vector<double>& values) const {
+    static std::atomic<unsigned> n_stored(0);
+    std::ostringstream tmp_path;
+    tmp_path << path(key) << ".tmp" << getpid() << "_" << n_stored++;
+
+    std::ofstream f(tmp_path.str(), std::ios::binary);
+    uint64_t key_size = key.size();
+    uint64_t n = values.size();
+    std::vector<char> key_bytes(padded(key.size()), 0);
+    std::copy(key.begin(), key.end(), key_bytes.begin());
+    f.write(magic, sizeof(magic));
+    f.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+    f.write(key_bytes.data(), key_bytes.size());
+    f.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    f.write(reinterpret_cast<const char*>(values.data()), n * sizeof(double));
+    f.close();
+    if (!f || std::rename(tmp_path.str().c_str(), path(key).c_str()) != 0) {
+        std::remove(tmp_path.str().c_str());
+    }
+}
+
+std::string key_double(double v) {
+    char text[32];
+    snprintf(text, sizeof(text), "%a", v);
+    return text;
+}
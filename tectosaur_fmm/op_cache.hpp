@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A read only dense operator, either computed in memory or mapped from a file
+// in an OpCache. Copies share the same values.
+class DenseOp {
+public:
+    DenseOp() = default;
+    explicit DenseOp(std::vector<double> values);
+
+    const double* data() const { return ptr; }
+    size_t size() const { return n; }
+    bool mapped() const { return is_mapped; }
+
+private:
+    std::shared_ptr<const void> storage;
+    const double* ptr = nullptr;
+    size_t n = 0;
+    bool is_mapped = false;
+
+    friend class OpCache;
+};
+
+// A directory of operators, each stored in a file named by a hash of its key.
+// The key has to describe everything the operator depends on. Files are
+// written once, atomically, and memory mapped on reuse, so several processes
+// can share one directory. An empty directory disables the cache.
+class OpCache {
+public:
+    // Creates dir and its missing parents, throwing std::runtime_error if
+    // that isn't possible.
+    explicit OpCache(std::string dir);
+
+    bool enabled() const { return !dir.empty(); }
+
+    // The operator for key, from the cache if it is there, otherwise from
+    // build, after which it is stored. Operators that can't be stored are
+    // still returned.
+    DenseOp get(const std::string& key,
+        const std::function<std::vector<double>()>& build) const;
+
+    std::string path(const std::string& key) const;
+
+private:
+    std::string dir;
+
+    DenseOp load(const std::string& key) const;
+    void store(const std::string& key, const std::vector<double>& values) const;
+};
+
+// Exact text for the doubles in a cache key.
+std::string key_double(double v);
@@ -44,6 +44,44 @@ inline std::vector<std::array<double,3>> surrounding_surface(size_t order)
     return pts;
 }
 
+// The number of points along each edge of the smallest cube surface grid
+// with at least order points.
+template <size_t dim>
+size_t cube_surface_side(size_t order) {
+    size_t side = 2;
+    while (std::pow(side, dim) - std::pow(side - 2, dim) < order) {
+        side++;
+    }
+    return side;
+}
+
+// The points of a regular grid with side points along each edge that lie on
+// the surface of a cube. The cube has half width 1 / sqrt(dim), so that it
+// fits in the unit sphere like surrounding_surface and inscribe_surf gives a
+// cube of half width scaling * width.
+template <size_t dim>
+std::vector<std::array<double,dim>> cube_surface(size_t side)
+{
+    std::vector<std::array<double,dim>> pts;
+    double half_width = 1.0 / std::sqrt(static_cast<double>(dim));
+    size_t n_grid = std::pow(side, dim);
+    for (size_t i = 0; i < n_grid; i++) {
+        std::array<double,dim> pt;
+        bool on_surface = false;
+        size_t rest = i;
+        for (int d = dim - 1; d >= 0; d--) {
+            size_t coord = rest % side;
+            rest /= side;
+            on_surface |= coord == 0 || coord == side - 1;
+            pt[d] = half_width * (2.0 * coord / (side - 1) - 1.0);
+        }
+        if (on_surface) {
+            pts.push_back(pt);
+        }
+    }
+    return pts;
+}
+
 template <size_t dim>
 std::vector<std::array<double,dim>> inscribe_surf(const Cube<dim>& b, double scaling,
                                 const std::vector<std::array<double,dim>>& fmm_surf) {
@@ -56,3 +94,13 @@ std::vector<std::array<double,dim>> inscribe_surf(const Cube<dim>& b, double sca
     return out;
 }
 
+template <size_t dim>
+SoAPts<dim> inscribe_surf_soa(const Cube<dim>& b, double scaling, const SoAPts<dim>& fmm_surf) {
+    SoAPts<dim> out(fmm_surf.size());
+    for (size_t d = 0; d < dim; d++) {
+        for (size_t i = 0; i < fmm_surf.size(); i++) {
+            out.xs[d * out.n + i] = fmm_surf.xs[d * out.n + i] * b.R() * scaling + b.center[d];
+        }
+    }
+    return out;
+}
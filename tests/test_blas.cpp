@@ -12,6 +12,15 @@ TEST_CASE("DGEMM test") {
     REQUIRE_ARRAY_EQUAL(result, correct, 4);
 }
 
+TEST_CASE("batch matrix vector product") {
+    std::vector<double> matrix{1,2,3,4,5,6};
+    std::vector<double> vectors{1,0,1,2,1,0};
+    std::vector<double> out{1,1,0,0};
+    batch_matrix_vector_product(matrix.data(), 2, 3, vectors.data(), 2, out.data());
+    std::vector<double> correct{5,11,4,13};
+    REQUIRE_ARRAY_EQUAL(out, correct, 4);
+}
+
 TEST_CASE("LU solve") 
 {
     std::vector<double> matrix{
@@ -48,6 +57,30 @@ TEST_CASE("Condition number")
     REQUIRE(cond == doctest::Approx(2.7630857945186595).epsilon(1e-12));
 }
 
+TEST_CASE("SVD singular vectors")
+{
+    std::vector<double> matrix{
+        1, 0, 0, 3
+    };
+    auto svd = svd_decompose(matrix.data(), 2, 2);
+    REQUIRE_ARRAY_CLOSE(singular_values(svd), std::vector<double>{3, 1}, 2, 1e-14);
+    REQUIRE(svd_rank(svd, 2.0) == 1);
+    auto U = left_singular_vectors(svd, 1);
+    REQUIRE(U.size() == 2);
+    REQUIRE(std::fabs(U[0]) == doctest::Approx(0.0));
+    REQUIRE(std::fabs(U[1]) == doctest::Approx(1.0));
+
+    // Column-major, so only the (1, 0) entry is nonzero.
+    std::vector<double> lower{0, 2, 0, 0};
+    auto lower_svd = svd_decompose(lower.data(), 2, 2);
+    auto u = left_singular_vectors(lower_svd, 1);
+    auto v = right_singular_vectors(lower_svd, 1);
+    REQUIRE(std::fabs(u[0]) == doctest::Approx(0.0));
+    REQUIRE(std::fabs(u[1]) == doctest::Approx(1.0));
+    REQUIRE(std::fabs(v[0]) == doctest::Approx(1.0));
+    REQUIRE(std::fabs(v[1]) == doctest::Approx(0.0));
+}
+
 TEST_CASE("matrix vector product out pointer")
 {
     
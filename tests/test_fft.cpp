@@ -0,0 +1,66 @@
+#include "fft.hpp"
+#include "doctest.h"
+#include "test_helpers.hpp"
+
+std::vector<std::complex<double>> naive_dft(const std::vector<std::complex<double>>& x) {
+    size_t n = x.size();
+    std::vector<std::complex<double>> out(n);
+    for (size_t k = 0; k < n; k++) {
+        for (size_t j = 0; j < n; j++) {
+            double theta = -2 * M_PI * double(j * k) / n;
+            out[k] += x[j] * std::complex<double>(std::cos(theta), std::sin(theta));
+        }
+    }
+    return out;
+}
+
+TEST_CASE("FFT matches DFT") {
+    for (size_t n: {1, 2, 7, 9, 12, 25}) {
+        std::vector<std::complex<double>> x(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = std::complex<double>(std::sin(i + 1.0), std::cos(3.0 * i));
+        }
+        auto correct = naive_dft(x);
+        auto result = x;
+        FFT(n).forward(result.data(), 1);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(std::abs(result[i] - correct[i]) < 1e-12);
+        }
+
+        FFT(n).inverse(result.data(), 1);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(std::abs(result[i] / double(n) - x[i]) < 1e-12);
+        }
+    }
+}
+
+TEST_CASE("FFT grid convolution") {
+    size_t n = 6;
+    FFT fft(n);
+    std::vector<std::complex<double>> a(n * n), b(n * n);
+    for (size_t i = 0; i < n * n; i++) {
+        a[i] = std::sin(i + 0.5);
+        b[i] = std::cos(2.0 * i);
+    }
+    std::vector<double> correct(n * n, 0.0);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            for (size_t k = 0; k < n; k++) {
+                for (size_t l = 0; l < n; l++) {
+                    correct[i * n + j] += a[k * n + l].real() *
+                        b[((i + n - k) % n) * n + (j + n - l) % n].real();
+                }
+            }
+        }
+    }
+
+    fft.forward_grid(a.data(), 2);
+    fft.forward_grid(b.data(), 2);
+    for (size_t i = 0; i < n * n; i++) {
+        a[i] *= b[i];
+    }
+    fft.inverse_grid(a.data(), 2);
+    for (size_t i = 0; i < n * n; i++) {
+        REQUIRE(a[i].real() / (n * n) == doctest::Approx(correct[i]));
+    }
+}
@@ -39,7 +39,8 @@ def m2l_test_pts(dim):
         return out
     return f
 
-def run_full(n, make_pts, mac, order, kernel, params, ocl = False, max_pts_per_cell = None):
+def run_full(n, make_pts, mac, order, kernel, params, ocl = False, max_pts_per_cell = None,
+        tree_type = 'Octree', tree_args = None, report = None):
     if max_pts_per_cell is None:
         max_pts_per_cell = order
     t = Timer()
@@ -53,13 +54,18 @@ def run_full(n, make_pts, mac, order, kernel, params, ocl = False, max_pts_per_c
 
     dim = obs_pts.shape[1]
 
-    obs_kd = module[dim].Octree(obs_pts, obs_ns, max_pts_per_cell)
-    src_kd = module[dim].Octree(src_pts, src_ns, max_pts_per_cell)
+    if tree_args is None:
+        tree_args = dict()
+    Tree = getattr(module[dim], tree_type)
+    obs_kd = Tree(obs_pts, obs_ns, max_pts_per_cell, **tree_args)
+    src_kd = Tree(src_pts, src_ns, max_pts_per_cell, **tree_args)
     t.report('build trees')
     fmm_mat = module[dim].fmmmmmmm(
         obs_kd, src_kd, module[dim].FMMConfig(1.1, mac, order, kernel, params)
     )
     t.report('setup fmm')
+    if report is not None:
+        report.update(fmm.report_interactions(fmm_mat))
 
     tdim = fmm_mat.tensor_dim
     input_vals = np.ones(src_pts.shape[0] * tdim)
@@ -143,5 +149,359 @@ def test_irregular():
     K = "laplaceS3"
     check_kernel(K, *run_full(10000, ellipsoid_pts, 2.6, 35, K, []))
 
+def test_adaptive_bounds():
+    K = "laplaceS3"
+    counts = []
+    for adaptive_bounds in [False, True]:
+        np.random.seed(10)
+        counts.append(dict())
+        check_kernel(K, *run_full(
+            10000, ellipsoid_pts, 2.6, 35, K, [],
+            tree_args = dict(adaptive_bounds = adaptive_bounds), report = counts[-1]
+        ))
+    for name in ['m2l', 'p2p', 'tree']:
+        test_print("adaptive bounds %s interactions: %e -> %e" %
+            (name, counts[0][name], counts[1][name]))
+
+    # Shrinking the nodes of a surface mesh separates more node pairs, so
+    # there are fewer direct point interactions.
+    assert(counts[1]['p2p'] <= counts[0]['p2p'])
+
+@pytest.fixture(params = [False, True])
+def spherical_bounds(request):
+    return request.param
+
+def test_kdtree(laplace_kernel, dim, spherical_bounds):
+    K = laplace_kernel + str(dim)
+    np.random.seed(10)
+    order = 16 if dim == 2 else 64
+    check_kernel(K, *run_full(
+        10000, rand_pts(dim), 2.6, order, K, [],
+        tree_type = 'KDTree', tree_args = dict(spherical_bounds = spherical_bounds)
+    ), accuracy = 1)
+
+def test_kdtree_irregular():
+    K = "laplaceS3"
+    check_kernel(K, *run_full(
+        10000, ellipsoid_pts, 2.6, 35, K, [],
+        tree_type = 'KDTree', tree_args = dict(spherical_bounds = True)
+    ))
+
+# A self interaction fmm for n_pts random points, laplace by default, with
+# extra FMMConfig arguments from cfg_args.
+def self_fmm(dim, tree_type = 'Octree', n_per_cell = None, n_pts = 5000,
+        kernel = 'laplaceS', params = [], order = None, **cfg_args):
+    K = kernel + str(dim)
+    np.random.seed(10)
+    if order is None:
+        order = 16 if dim == 2 else 64
+    if n_per_cell is None:
+        n_per_cell = order
+    pts = np.random.rand(n_pts, dim)
+    ns = pts / np.linalg.norm(pts, axis = 1)[:,np.newaxis]
+    tree = getattr(module[dim], tree_type)(pts, ns, n_per_cell)
+    fmm_mat = module[dim].fmmmmmmm(
+        tree, tree, module[dim].FMMConfig(1.1, 2.6, order, K, params, **cfg_args)
+    )
+    return tree, fmm_mat
+
+# The nodes whose values are read by one of ops, and their descendants,
+# which the values are passed down to.
+def used_nodes(tree, ops, field):
+    used = np.zeros(tree.n_nodes, dtype = bool)
+    for op in ops:
+        used[getattr(op, field)] = True
+    # Parents are stored before their children.
+    for n in tree.nodes:
+        if used[n.idx]:
+            used[n.children] = True
+    return np.flatnonzero(used)
+
+def test_prune(dim):
+    tree, fmm_mat = self_fmm(dim)
+    n_u2e = sum([len(fmm_mat.u2e[i].src_n_idx) for i in range(len(fmm_mat.u2e))])
+    n_d2e = sum([len(fmm_mat.d2e[i].obs_n_idx) for i in range(len(fmm_mat.d2e))])
+    assert(fmm_mat.pruned.u2e > 0)
+    assert(n_u2e + fmm_mat.pruned.u2e == tree.n_nodes)
+    assert(n_d2e + fmm_mat.pruned.d2e == tree.n_nodes)
+
+    # Exactly the multipoles that m2l or m2p read and the locals that m2l
+    # or p2l write to are kept.
+    kept_u2e = np.sort(np.concatenate([op.src_n_idx for op in fmm_mat.u2e]))
+    kept_d2e = np.sort(np.concatenate([op.obs_n_idx for op in fmm_mat.d2e]))
+    np.testing.assert_equal(
+        kept_u2e, used_nodes(tree, [fmm_mat.m2l, fmm_mat.m2p], 'src_n_idx')
+    )
+    np.testing.assert_equal(
+        kept_d2e, used_nodes(tree, [fmm_mat.m2l, fmm_mat.p2l], 'obs_n_idx')
+    )
+
+def test_obs_groups(dim):
+    order = 16 if dim == 2 else 64
+    tree, fmm_mat = self_fmm(dim, 'KDTree', order // 4)
+
+    # The groups of entries that write to points cover separate point ranges
+    # and the groups of entries that write to nodes each have one node.
+    for op in [fmm_mat.p2p, fmm_mat.m2p, fmm_mat.l2p]:
+        starts = op.group_starts
+        assert(starts[-1] == len(op.obs_n_idx))
+        ranges = [
+            (op.obs_n_start[a:b].min(), op.obs_n_end[a:b].max())
+            for a, b in zip(starts[:-1], starts[1:])
+        ]
+        for r1, r2 in zip(ranges[:-1], ranges[1:]):
+            assert(r1[1] <= r2[0])
+    for op in [fmm_mat.p2m, fmm_mat.p2l, fmm_mat.m2l]:
+        starts = op.group_starts
+        assert(starts[-1] == len(op.obs_n_idx))
+        assert(np.all(np.diff(op.obs_n_idx[starts[:-1]]) > 0))
+        for a, b in zip(starts[:-1], starts[1:]):
+            assert(np.all(op.obs_n_idx[a:b] == op.obs_n_idx[a]))
+
+    # p2p runs the groups in parallel and merges the entries of a group with
+    # adjacent src ranges, which has to give the same sum as the entries one
+    # at a time.
+    K = fmm_mat.cfg.kernel_name
+    pts = np.ascontiguousarray(tree.pts)
+    ns = np.ascontiguousarray(tree.normals)
+    input_vals = np.random.rand(pts.shape[0])
+    est = np.zeros(pts.shape[0])
+    fmm_mat.p2p_eval(est, input_vals)
+    correct = np.zeros(pts.shape[0])
+    p2p = fmm_mat.p2p
+    entries = zip(p2p.obs_n_start, p2p.obs_n_end, p2p.src_n_start, p2p.src_n_end)
+    for obs_start, obs_end, src_start, src_end in entries:
+        obs = slice(obs_start, obs_end)
+        src = slice(src_start, src_end)
+        correct[obs] += module[dim].mf_direct_eval(
+            K, pts[obs], ns[obs], pts[src], ns[src], np.array([]), input_vals[src]
+        )
+    np.testing.assert_allclose(est, correct, rtol = 0, atol = 1e-12 * np.max(np.abs(correct)))
+
+def test_refit(dim):
+    K = 'laplaceS' + str(dim)
+    np.random.seed(10)
+    order = 16 if dim == 2 else 64
+    pts = np.random.rand(10000, dim)
+    ns = pts / np.linalg.norm(pts, axis = 1)[:,np.newaxis]
+    tree = module[dim].Octree(pts, ns, order)
+    fmm_mat = module[dim].fmmmmmmm(
+        tree, tree, module[dim].FMMConfig(1.1, 2.6, order, K, [])
+    )
+
+    assert(fmm_mat.self_interaction)
+
+    # Shrink slightly so that every point stays inside the root cell.
+    moved = 0.97 * pts + 0.01 + 0.01 * np.random.rand(*pts.shape)
+
+    # The matrix shares the tree, so refitting the tree leaves it alone.
+    old_pts = np.array(tree.pts)
+    refit_tree = tree.refit(moved, ns)
+    assert(refit_tree is not None)
+    np.testing.assert_equal(np.array(tree.pts), old_pts)
+    np.testing.assert_equal(np.array(fmm_mat.obs_tree.pts), old_pts)
+
+    assert(fmm_mat.refit(moved, ns, moved, ns))
+    assert(fmm_mat.self_interaction)
+    est = fmm.eval_cpu(fmm_mat, np.ones(pts.shape[0]))
+    obs_tree = fmm_mat.obs_tree
+    src_tree = fmm_mat.src_tree
+    check_kernel(K,
+        np.array(obs_tree.pts), np.array(obs_tree.normals),
+        np.array(src_tree.pts), np.array(src_tree.normals), est, accuracy = 1
+    )
+
+def test_m2l_cache(dim):
+    tree, matrix_free = self_fmm(dim, m2l_cache_bytes = 0)
+    tree, cached = self_fmm(dim)
+    assert(matrix_free.n_m2l_ops == 0)
+    assert(cached.n_m2l_ops > 0)
+
+    # The cached operators are the same kernel matrices that the matrix free
+    # m2l evaluates, so only the rounding differs.
+    input_vals = np.random.rand(tree.pts.shape[0])
+    correct = matrix_free.eval(input_vals)
+    np.testing.assert_allclose(
+        cached.eval(input_vals), correct, rtol = 0, atol = 1e-12 * np.max(np.abs(correct))
+    )
+
+def test_m2l_svd(dim):
+    tol = 1e-4
+    tree, uncompressed = self_fmm(dim)
+    tree, fmm_mat = self_fmm(dim, m2l_svd_tol = tol)
+    ranks = fmm_mat.m2l_svd_ranks
+    assert(len(ranks) > 0)
+    assert(max(ranks) < fmm_mat.cfg.order)
+
+    # The dropped singular values are below tol times the largest, so the
+    # result stays within about tol of the uncompressed operators'.
+    input_vals = np.ones(tree.pts.shape[0])
+    correct = uncompressed.eval(input_vals)
+    np.testing.assert_allclose(
+        fmm_mat.eval(input_vals), correct, rtol = 0, atol = tol * np.max(np.abs(correct))
+    )
+
+# The m2l from the kernel matrix between the check and equivalent surfaces
+# of each node pair.
+def dense_m2l(fmm_mat, multipoles):
+    cfg = fmm_mat.cfg
+    surf = np.ascontiguousarray(fmm_mat.surf)
+    dim = surf.shape[1]
+    n_rows = surf.shape[0] * fmm_mat.tensor_dim
+    obs_nodes = fmm_mat.obs_tree.nodes
+    src_nodes = fmm_mat.src_tree.nodes
+    def node_surf(n):
+        return np.array(n.bounds.center) + surf * n.bounds.width * np.sqrt(dim) * cfg.inner_r
+
+    out = np.zeros(len(obs_nodes) * n_rows)
+    for obs_idx, src_idx in zip(fmm_mat.m2l.obs_n_idx, fmm_mat.m2l.src_n_idx):
+        op = module[dim].direct_eval(
+            cfg.kernel_name, node_surf(obs_nodes[obs_idx]), surf,
+            node_surf(src_nodes[src_idx]), surf, np.array(cfg.params)
+        ).reshape((n_rows, n_rows))
+        out[obs_idx * n_rows:(obs_idx + 1) * n_rows] += op.dot(
+            multipoles[src_idx * n_rows:(src_idx + 1) * n_rows]
+        )
+    return out
+
+def check_fft_m2l(dim, **args):
+    # In 3D, the nodes with enough points for an m2l are only separated with
+    # more points than usual.
+    n_pts = 5000 if dim == 2 else 20000
+    tree, fmm_mat = self_fmm(dim, n_pts = n_pts, fft_m2l = True, **args)
+    assert(fmm_mat.n_m2l_fft_ops > 0)
+    assert(len(fmm_mat.surf) >= fmm_mat.cfg.order)
+
+    # The transforms are exact, so the FFT m2l matches the dense kernel
+    # matrices up to rounding.
+    n_rows = len(fmm_mat.surf) * fmm_mat.tensor_dim
+    multipoles = np.random.rand(tree.n_nodes * n_rows)
+    l_check = np.zeros(tree.n_nodes * n_rows)
+    fmm_mat.m2l_eval(l_check, multipoles)
+    correct = dense_m2l(fmm_mat, multipoles)
+    np.testing.assert_allclose(
+        l_check, correct, rtol = 0, atol = 1e-12 * np.max(np.abs(correct))
+    )
+
+    # A budget for one src node at a time translates every obs node in its
+    # own batch, with the same result.
+    tree, batched_mat = self_fmm(
+        dim, n_pts = n_pts, fft_m2l = True, fft_m2l_bytes = 1, **args
+    )
+    input_vals = np.random.rand(tree.pts.shape[0] * fmm_mat.tensor_dim)
+    np.testing.assert_equal(batched_mat.eval(input_vals), fmm_mat.eval(input_vals))
+
+def test_fft_m2l(dim):
+    check_fft_m2l(dim)
+
+def test_fft_m2l_elastic():
+    check_fft_m2l(3, kernel = 'elasticU', params = [1.0, 0.25])
+
+def test_c2e_svd(dim):
+    tol = 1e-2
+    # At the usual 2D order, the c2e operators don't have a low rank.
+    order = 40 if dim == 2 else 64
+    tree, uncompressed = self_fmm(dim, order = order)
+    tree, fmm_mat = self_fmm(dim, order = order, c2e_svd_tol = tol)
+    n_rows = len(fmm_mat.surf)
+    assert(max(fmm_mat.u2e_ranks + fmm_mat.d2e_ranks) < n_rows)
+    assert(len(fmm_mat.u2e_ops) == len(fmm_mat.u2e_ranks) * n_rows ** 2)
+
+    # The dropped singular values are below tol times the largest, so the
+    # result stays within about tol of the full pseudoinverse's.
+    input_vals = np.ones(tree.pts.shape[0])
+    correct = uncompressed.eval(input_vals)
+    np.testing.assert_allclose(
+        fmm_mat.eval(input_vals), correct, rtol = 0, atol = tol * np.max(np.abs(correct))
+    )
+
+def test_op_cache(dim, tmpdir):
+    tree, fmm_mat = self_fmm(dim, op_cache_dir = str(tmpdir))
+    files = sorted(tmpdir.listdir())
+    assert(len(files) > 0)
+    assert(fmm_mat.n_mapped_c2e_ops == 0)
+
+    # The second build maps every operator from the files of the first and
+    # writes no new ones.
+    tree, cached_mat = self_fmm(dim, op_cache_dir = str(tmpdir))
+    n_ops = len(cached_mat.u2e_ranks) + len(cached_mat.d2e_ranks)
+    assert(cached_mat.n_mapped_c2e_ops == n_ops)
+    assert(sorted(tmpdir.listdir()) == files)
+
+    input_vals = np.random.rand(tree.pts.shape[0])
+    np.testing.assert_equal(cached_mat.eval(input_vals), fmm_mat.eval(input_vals))
+
+def eval_passes(fmm_mat, input_vals):
+    n_out = fmm_mat.obs_tree.pts.shape[0] * fmm_mat.tensor_dim
+    n_rows = len(fmm_mat.surf) * fmm_mat.tensor_dim
+    out = np.zeros(n_out)
+    m_check = np.zeros(fmm_mat.src_tree.n_nodes * n_rows)
+    multipoles = np.zeros_like(m_check)
+    l_check = np.zeros(fmm_mat.obs_tree.n_nodes * n_rows)
+    locals = np.zeros_like(l_check)
+
+    fmm_mat.p2m_eval(m_check, input_vals)
+    fmm_mat.u2e_eval(multipoles, m_check, 0)
+    for i in range(1, len(fmm_mat.m2m)):
+        fmm_mat.m2m_eval(m_check, multipoles, i)
+        fmm_mat.u2e_eval(multipoles, m_check, i)
+
+    fmm_mat.p2l_eval(l_check, input_vals)
+    fmm_mat.m2l_eval(l_check, multipoles)
+    fmm_mat.d2e_eval(locals, l_check, 0)
+    for i in range(1, len(fmm_mat.l2l)):
+        fmm_mat.l2l_eval(l_check, locals, i)
+        fmm_mat.d2e_eval(locals, l_check, i)
+
+    fmm_mat.l2p_eval(out, locals)
+    fmm_mat.p2p_eval(out, input_vals)
+    fmm_mat.m2p_eval(out, multipoles)
+    return out
+
+def test_eval_matches_passes(dim):
+    tree, fmm_mat = self_fmm(dim)
+
+    # eval overlaps the passes in a task graph, which only changes the order
+    # that the near and far field values are summed in.
+    input_vals = np.random.rand(tree.pts.shape[0])
+    correct = eval_passes(fmm_mat, input_vals)
+    np.testing.assert_allclose(fmm_mat.eval(input_vals), correct, rtol = 1e-12, atol = 1e-12)
+
+def test_eval_threads(dim):
+    import concurrent.futures
+    tree, fmm_mat = self_fmm(dim)
+
+    # eval releases the GIL, so these run at the same time with separate
+    # workspaces and have to match the evals run one at a time.
+    inputs = [np.random.rand(tree.pts.shape[0]) for i in range(4)]
+    correct = [fmm_mat.eval(v) for v in inputs]
+    with concurrent.futures.ThreadPoolExecutor(4) as pool:
+        results = list(pool.map(fmm_mat.eval, inputs))
+    for r, c in zip(results, correct):
+        np.testing.assert_equal(r, c)
+
+def test_refit_during_eval(dim):
+    import concurrent.futures
+    tree, fmm_mat = self_fmm(dim)
+    n = tree.pts.shape[0]
+
+    # refit takes the points in their original order.
+    orig_order = np.argsort(np.array(tree.orig_idxs))
+    pts = np.array(tree.pts)[orig_order]
+    ns = np.array(tree.normals)[orig_order]
+    moved = 0.97 * pts + 0.01 + 0.01 * np.random.rand(*pts.shape)
+
+    # refit waits for the evals that are running, so each eval sees either
+    # the old or the refit matrix, never a mix.
+    input_vals = np.random.rand(n)
+    before = fmm_mat.eval(input_vals)
+    with concurrent.futures.ThreadPoolExecutor(4) as pool:
+        futures = [pool.submit(fmm_mat.eval, input_vals) for i in range(8)]
+        assert(fmm_mat.refit(moved, ns, moved, ns))
+        results = [f.result() for f in futures]
+    after = fmm_mat.eval(input_vals)
+    for r in results:
+        assert(np.array_equal(r, before) or np.array_equal(r, after))
+
 if __name__ == '__main__':
     test_ones(2)
@@ -0,0 +1,66 @@
+#include "doctest.h"
+#include "test_helpers.hpp"
+#include "kdtree.hpp"
+
+TEST_CASE("kdtree splits at the median") {
+    auto pts = random_pts<3>(1000);
+    KDTree<3> tree(pts.data(), pts.data(), pts.size(), 10);
+    for (auto& n: tree.nodes) {
+        if (n.is_leaf) {
+            REQUIRE(n.end - n.start <= 10);
+            continue;
+        }
+        auto& left = tree.nodes[n.children()[0]];
+        auto& right = tree.nodes[n.children()[1]];
+        REQUIRE(left.start == n.start);
+        REQUIRE(left.end == right.start);
+        REQUIRE(right.end == n.end);
+        REQUIRE(right.end - right.start - (left.end - left.start) <= 1);
+        REQUIRE(left.depth == n.depth + 1);
+        REQUIRE(n.height == std::max(left.height, right.height) + 1);
+    }
+}
+
+TEST_CASE("kdtree box bounds contain their pts") {
+    auto pts = random_pts<2>(1000);
+    KDTree<2> tree(pts.data(), pts.data(), pts.size(), 5);
+    for (auto& n: tree.nodes) {
+        REQUIRE_CLOSE(n.bounds.width, tree.level_width(n.bounds_level), 1e-15);
+        REQUIRE(n.bounds_level <= tree.max_height);
+        for (size_t i = n.start; i < n.end; i++) {
+            REQUIRE(in_box(n.bounds, tree.pts[i]));
+        }
+    }
+}
+
+TEST_CASE("kdtree spherical bounds contain their pts") {
+    auto pts = random_pts<3>(1000);
+    KDTree<3> tree(pts.data(), pts.data(), pts.size(), 5, true);
+    for (auto& n: tree.nodes) {
+        for (size_t i = n.start; i < n.end; i++) {
+            REQUIRE(dist(n.bounds.center, tree.pts[i]) <= n.bounds.R() * (1 + 1e-14));
+        }
+    }
+}
+
+TEST_CASE("kdtree with duplicate points") {
+    std::vector<std::array<double,2>> pts(100, {1.0, 2.0});
+    KDTree<2> tree(pts.data(), pts.data(), pts.size(), 1);
+    REQUIRE(tree.max_height == 7);
+    REQUIRE(tree.root().end == 100);
+}
+
+TEST_CASE("refit kdtree bounds contain the moved pts") {
+    auto pts = random_pts<2>(1000);
+    KDTree<2> tree(pts.data(), pts.data(), pts.size(), 10);
+    for (auto& p: pts) {
+        p[0] *= 1.5;
+    }
+    REQUIRE(tree.refit(pts.data(), pts.data()));
+    for (auto& n: tree.nodes) {
+        for (size_t i = n.start; i < n.end; i++) {
+            REQUIRE(tree.pts[i] == pts[tree.orig_idxs[i]]);
+            REQUIRE(in_box(n.bounds, tree.pts[i]));
+        }
+    }
+}
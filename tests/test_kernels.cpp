@@ -0,0 +1,66 @@
+#include "fmm_kernels.hpp"
+#include "doctest.h"
+#include "test_helpers.hpp"
+
+// Compares the hand vectorized loops at every level the cpu supports with the
+// compiler vectorized loop. 13 sources leave a partial group at every width
+// and the repeated point checks that coincident pairs are dropped.
+TEST_CASE("simd kernels match the pair kernels") {
+    size_t n_obs = 5;
+    size_t n_src = 13;
+    auto obs = random_pts<3>(n_obs, -1, 1);
+    auto src = random_pts<3>(n_src, -1, 1);
+    obs[2] = src[11];
+    auto obs_ns = random_pts<3>(n_obs, -1, 1);
+    auto src_ns = random_pts<3>(n_src, -1, 1);
+
+    std::vector<double> pts(3 * (n_obs + n_src));
+    std::vector<double> ns(3 * (n_obs + n_src));
+    NBodyProblem<3> p{};
+    for (size_t d = 0; d < 3; d++) {
+        double* obs_d = &pts[d * (n_obs + n_src)];
+        double* src_d = obs_d + n_obs;
+        double* obs_ns_d = &ns[d * (n_obs + n_src)];
+        double* src_ns_d = obs_ns_d + n_obs;
+        for (size_t i = 0; i < n_obs; i++) {
+            obs_d[i] = obs[i][d];
+            obs_ns_d[i] = obs_ns[i][d];
+        }
+        for (size_t j = 0; j < n_src; j++) {
+            src_d[j] = src[j][d];
+            src_ns_d[j] = src_ns[j][d];
+        }
+        p.obs_pts[d] = obs_d;
+        p.src_pts[d] = src_d;
+        p.obs_ns[d] = obs_ns_d;
+        p.src_ns[d] = src_ns_d;
+    }
+    p.n_obs = n_obs;
+    p.n_src = n_src;
+    std::vector<double> params{1.3, 0.27};
+    p.kernel_args = params.data();
+
+    std::vector<void (*)(SimdLevel, const NBodyProblem<3>&, KernelReal*, KernelReal*)> fncs{
+        simd_mf_laplaceS3, simd_mf_laplaceD3, simd_mf_laplaceH3, simd_mf_elasticU3
+    };
+    std::vector<int> tensor_dims{1, 1, 1, 3};
+    std::vector<SimdLevel> levels{SimdLevel::sse2, SimdLevel::avx2, SimdLevel::avx512};
+    for (size_t k = 0; k < fncs.size(); k++) {
+        std::vector<double> in(tensor_dims[k] * n_src);
+        for (size_t j = 0; j < in.size(); j++) {
+            in[j] = std::cos(3.0 * j);
+        }
+        std::vector<double> correct(tensor_dims[k] * n_obs, 1.0);
+        fncs[k](SimdLevel::none, p, correct.data(), in.data());
+        for (auto level: levels) {
+            if (level > max_simd_level()) {
+                continue;
+            }
+            std::vector<double> result(tensor_dims[k] * n_obs, 1.0);
+            fncs[k](level, p, result.data(), in.data());
+            for (size_t i = 0; i < result.size(); i++) {
+                REQUIRE_CLOSE(result[i], correct[i], 1e-12 * (1 + std::fabs(correct[i])));
+            }
+        }
+    }
+}
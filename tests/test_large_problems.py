@@ -64,6 +64,21 @@ def test_build_big():
     octree = fmm.three.Octree(pts, pts, 1)
     print("octree took: " + str(time.time() - start))
 
+@slow
+def test_build_bench():
+    import time
+    for n in [1000000, 10000000]:
+        pts = np.random.rand(n, 3)
+        times = []
+        for morton in [False, True]:
+            start = time.time()
+            octree = fmm.three.Octree(pts, pts, 10, morton = morton)
+            times.append(time.time() - start)
+        print(
+            "%d pts, partition build took: %f, morton build took: %f, speedup: %f"
+            % (n, times[0], times[1], times[0] / times[1])
+        )
+
 @slow
 def test_high_accuracy():
     import time
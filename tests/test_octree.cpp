@@ -2,6 +2,8 @@
 #include "test_helpers.hpp"
 #include "octree.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
 TEST_CASE("containing subcell box 2d") {
@@ -75,6 +77,101 @@ TEST_CASE("octree partition") {
     }
 }
 
+// The copying partition that octree_partition replaced. Each subcell's
+// points go into their own vector and are copied back in order.
+template <size_t dim>
+std::array<int,OctreeNode<dim>::split+1> copying_partition(
+        const Cube<dim>& bounds, PtNormal<dim>* start, PtNormal<dim>* end)
+{
+    std::array<std::vector<PtNormal<dim>>,OctreeNode<dim>::split> chunks{};
+    for (auto* entry = start; entry < end; entry++) {
+        chunks[find_containing_subcell(bounds, entry->pt)].push_back(*entry);
+    }
+    auto* next = start;
+    std::array<int,OctreeNode<dim>::split+1> splits{};
+    for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
+        next = std::copy(chunks[i].begin(), chunks[i].end(), next);
+        splits[i + 1] = splits[i] + chunks[i].size();
+    }
+    return splits;
+}
+
+// Partitions every node down to n_per_cell points, like a tree build
+// without the nodes.
+template <size_t dim, typename F>
+void partition_all(const Cube<dim>& bounds, PtNormal<dim>* start, PtNormal<dim>* end,
+    size_t n_per_cell, int depth, const F& partition)
+{
+    if (static_cast<size_t>(end - start) <= n_per_cell || depth == 30) {
+        return;
+    }
+    auto splits = partition(bounds, start, end);
+    for (size_t i = 0; i < OctreeNode<dim>::split; i++) {
+        partition_all(get_subcell(bounds, make_child_idx<dim>(i)),
+            start + splits[i], start + splits[i + 1], n_per_cell, depth + 1, partition);
+    }
+}
+
+// Partitions both copies of the same points down to n_per_cell points per
+// node, checking that each node splits the same way.
+void check_same_partitions(const Cube<3>& bounds, PtNormal<3>* in_place,
+    PtNormal<3>* copied, size_t n_pts, size_t n_per_cell)
+{
+    if (n_pts <= n_per_cell) {
+        return;
+    }
+    auto splits = octree_partition(bounds, in_place, in_place + n_pts);
+    REQUIRE(splits == copying_partition(bounds, copied, copied + n_pts));
+    for (size_t i = 0; i < 8; i++) {
+        check_same_partitions(get_subcell(bounds, make_child_idx<3>(i)),
+            in_place + splits[i], copied + splits[i], splits[i + 1] - splits[i], n_per_cell);
+    }
+}
+
+TEST_CASE("in place partition matches the copying partition") {
+    size_t n_pts = 1000;
+    auto pts = random_pts<3>(n_pts, -1, 1);
+    auto ns = random_pts<3>(n_pts, -1, 1);
+    auto in_place = combine_pts_normals(pts.data(), ns.data(), n_pts);
+    auto copied = in_place;
+    auto bounds = bounding_box(in_place.data(), n_pts);
+    check_same_partitions(bounds, in_place.data(), copied.data(), n_pts, 10);
+
+    // The in place partition is unstable, so the leaves hold the same points
+    // in a different order.
+    auto by_idx = [] (const PtNormal<3>& a, const PtNormal<3>& b) {
+        return a.orig_idx < b.orig_idx;
+    };
+    std::sort(in_place.begin(), in_place.end(), by_idx);
+    std::sort(copied.begin(), copied.end(), by_idx);
+    for (size_t i = 0; i < n_pts; i++) {
+        REQUIRE(in_place[i].orig_idx == copied[i].orig_idx);
+    }
+}
+
+// Run with --no-skip to time both partitions over whole trees.
+TEST_CASE("partition benchmark" * doctest::skip()) {
+    for (size_t n_pts: {1000000, 10000000}) {
+        auto pts = random_pts<3>(n_pts, 0, 1);
+        auto pts_normals = combine_pts_normals(pts.data(), pts.data(), n_pts);
+        auto bounds = bounding_box(pts_normals.data(), n_pts);
+        auto time_partition = [&] (std::vector<PtNormal<3>> v, auto partition) {
+            auto start = std::chrono::high_resolution_clock::now();
+            partition_all(bounds, v.data(), v.data() + n_pts, 10, 0, partition);
+            return std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - start
+            ).count();
+        };
+        std::array<double,2> times{
+            time_partition(pts_normals, copying_partition<3>),
+            time_partition(pts_normals, octree_partition<3>)
+        };
+        std::cout << n_pts << " pts, copying partition took: " << times[0]
+            << ", in place partition took: " << times[1]
+            << ", speedup: " << times[0] / times[1] << std::endl;
+    }
+}
+
 TEST_CASE("one level octree") 
 {
     auto es = random_pts<3>(3);
@@ -92,5 +189,180 @@ TEST_CASE("many level octree")
     auto pts = random_pts<3>(1000);
     Octree<3> oct(pts.data(), pts.data(), pts.size(), 999); 
     REQUIRE(oct.orig_idxs.size() == 1000);
-    REQUIRE(oct.nodes[oct.root().children[0]].depth == 1);
+    REQUIRE(oct.nodes[oct.root().children()[0]].depth == 1);
+}
+
+TEST_CASE("morton key leading digit is the containing subcell") {
+    size_t n_pts = 100;
+    auto pts = random_pts<3>(n_pts, -1, 1);
+    auto bounds = bounding_box(pts.data(), n_pts);
+    auto keys = morton_keys(bounds, pts.data(), n_pts);
+    int shift = 3 * (morton_levels<3>() - 1);
+    for (size_t i = 0; i < n_pts; i++) {
+        REQUIRE(int(keys[i] >> shift) == find_containing_subcell(bounds, pts[i]));
+    }
+}
+
+TEST_CASE("radix sort") {
+    size_t n = 10000;
+    std::mt19937_64 gen(10);
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = gen() >> (i % 40);
+    }
+    auto orig_keys = keys;
+    auto idxs = radix_sort(keys);
+    REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+    for (size_t i = 0; i < n; i++) {
+        REQUIRE(keys[i] == orig_keys[idxs[i]]);
+    }
+}
+
+TEST_CASE("octree children hold their octant") {
+    auto pts = random_pts<3>(10000);
+    Octree<3> oct(pts.data(), pts.data(), pts.size(), 10);
+    for (auto& n: oct.nodes) {
+        if (n.is_leaf) {
+            continue;
+        }
+        for (size_t octant = 0; octant < 8; octant++) {
+            auto& child = oct.nodes[n.children()[octant]];
+            for (size_t i = child.start; i < child.end; i++) {
+                REQUIRE(find_containing_subcell(n.bounds, oct.pts[i]) == int(octant));
+            }
+        }
+    }
+}
+
+TEST_CASE("morton and partition octrees match") {
+    auto pts = random_pts<2>(10000);
+    Octree<2> morton(pts.data(), pts.data(), pts.size(), 3, true);
+    Octree<2> partition(pts.data(), pts.data(), pts.size(), 3, false);
+    REQUIRE(morton.nodes.size() == partition.nodes.size());
+    for (size_t i = 0; i < morton.nodes.size(); i++) {
+        REQUIRE(morton.nodes[i].start == partition.nodes[i].start);
+        REQUIRE(morton.nodes[i].end == partition.nodes[i].end);
+        REQUIRE(morton.nodes[i].first_child == partition.nodes[i].first_child);
+    }
+    REQUIRE(morton.orig_idxs == partition.orig_idxs);
+}
+
+TEST_CASE("adaptive bounds shrink to the points") {
+    std::vector<std::array<double,2>> pts{{0, 0}, {1, 1}, {0.9, 0.9}, {0.91, 0.9}};
+    Octree<2> oct(pts.data(), pts.data(), pts.size(), 1, true, true);
+    auto& n = oct.nodes[oct.root().children()[3]];
+    REQUIRE(n.end - n.start == 3);
+    REQUIRE(n.bounds_level == 3);
+    REQUIRE_CLOSE(n.bounds.width, oct.level_width(3), 1e-15);
+    REQUIRE_ARRAY_CLOSE(n.bounds.center, (std::array<double,2>{0.95, 0.95}), 2, 1e-15);
+}
+
+TEST_CASE("adaptive bounds only move nodes that shrink") {
+    // A tight cluster in a corner, so some nodes shrink.
+    auto pts = random_pts<3>(1000);
+    for (size_t i = 0; i < 200; i++) {
+        for (auto& x: pts[i]) {
+            x = 0.9 + 0.01 * x;
+        }
+    }
+    Octree<3> oct(pts.data(), pts.data(), pts.size(), 10, true, true);
+    auto cells = oct.cells();
+    size_t n_shrunk = 0;
+    for (auto& n: oct.nodes) {
+        if (n.bounds_level > n.depth) {
+            n_shrunk++;
+            continue;
+        }
+        REQUIRE(n.bounds.width == cells[n.idx].width);
+        REQUIRE(n.bounds.center == cells[n.idx].center);
+    }
+    REQUIRE(n_shrunk > 0);
+}
+
+TEST_CASE("duplicate points end up in one leaf") {
+    auto pts = random_pts<3>(100);
+    for (size_t i = 0; i < 50; i++) {
+        pts.push_back({0.5, 0.5, 0.5});
+    }
+    for (bool morton: {true, false}) {
+        Octree<3> oct(pts.data(), pts.data(), pts.size(), 1, morton);
+        size_t biggest = 0;
+        for (auto& n: oct.nodes) {
+            if (n.is_leaf) {
+                biggest = std::max<size_t>(biggest, n.end - n.start);
+            }
+        }
+        REQUIRE(biggest >= 50);
+        REQUIRE(oct.max_height < Octree<3>::default_max_depth);
+    }
+}
+
+TEST_CASE("max depth caps the tree") {
+    auto pts = random_pts<2>(1000);
+    Octree<2> oct(pts.data(), pts.data(), pts.size(), 1, true, false, 3);
+    REQUIRE(oct.max_height == 3);
+    for (auto& n: oct.nodes) {
+        REQUIRE(n.depth <= 3);
+        REQUIRE(n.is_leaf == (n.depth == 3 || n.end - n.start <= 1));
+    }
+}
+
+TEST_CASE("octree nodes are stored level by level") {
+    auto pts = random_pts<3>(1000);
+    Octree<3> oct(pts.data(), pts.data(), pts.size(), 10);
+    REQUIRE(oct.level_starts.size() == size_t(oct.max_height + 2));
+    REQUIRE(oct.level_starts.back() == oct.nodes.size());
+    for (size_t d = 0; d + 1 < oct.level_starts.size(); d++) {
+        for (size_t i = oct.level_starts[d]; i < oct.level_starts[d + 1]; i++) {
+            REQUIRE(oct.nodes[i].depth == int(d));
+        }
+    }
+    for (auto& n: oct.nodes) {
+        auto start = n.start;
+        for (auto child_idx: n.children()) {
+            REQUIRE(oct.nodes[child_idx].start == start);
+            start = oct.nodes[child_idx].end;
+        }
+        REQUIRE((n.is_leaf || start == n.end));
+    }
+}
+
+TEST_CASE("octree points are stored coordinate by coordinate") {
+    auto pts = random_pts<3>(100);
+    Octree<3> oct(pts.data(), pts.data(), pts.size(), 10);
+    auto& n = oct.nodes[oct.root().first_child];
+    auto view = oct.pts.view(n.start);
+    for (size_t i = 0; i < n.end - n.start; i++) {
+        for (size_t d = 0; d < 3; d++) {
+            REQUIRE(view[d][i] == pts[oct.orig_idxs[n.start + i]][d]);
+        }
+    }
+}
+
+TEST_CASE("refit octree matches a fresh build") {
+    auto pts = random_pts<3>(1000);
+    Octree<3> oct(pts.data(), pts.data(), pts.size(), 10);
+    for (size_t i = 0; i < 100; i++) {
+        std::swap(pts[i], pts[pts.size() - 1 - i]);
+    }
+    REQUIRE(oct.refit(pts.data(), pts.data()));
+    Octree<3> fresh(pts.data(), pts.data(), pts.size(), 10);
+    REQUIRE(oct.nodes.size() == fresh.nodes.size());
+    auto cells = oct.cells();
+    for (size_t i = 0; i < oct.nodes.size(); i++) {
+        auto& n = oct.nodes[i];
+        REQUIRE(n.start == fresh.nodes[i].start);
+        REQUIRE(n.end == fresh.nodes[i].end);
+        for (size_t j = n.start; j < n.end; j++) {
+            REQUIRE(oct.pts[j] == pts[oct.orig_idxs[j]]);
+            REQUIRE(in_box(cells[i], oct.pts[j]));
+        }
+    }
+}
+
+TEST_CASE("refit octree fails for points leaving the root") {
+    auto pts = random_pts<2>(100);
+    Octree<2> oct(pts.data(), pts.data(), pts.size(), 10);
+    pts[0] = {2.0, 2.0};
+    REQUIRE(!oct.refit(pts.data(), pts.data()));
 }
@@ -25,6 +25,17 @@ def test_contains_pts(dim):
         for i in range(n.start, n.end):
             assert(module[dim].in_box(n.bounds, pts[i,:].tolist()))
 
+def test_adaptive_bounds(dim):
+    pts = np.random.rand(100,dim)
+    t = module[dim].Octree(pts, pts, 1, adaptive_bounds = True)
+    pts = np.array(t.pts)
+    root_width = t.root().bounds.width * (2.0 ** t.root().bounds_level)
+    for n in t.nodes:
+        assert(n.bounds_level >= n.depth)
+        assert(n.bounds.width == root_width / (2.0 ** n.bounds_level))
+        for i in range(n.start, n.end):
+            assert(module[dim].in_box(n.bounds, pts[i,:].tolist()))
+
 def test_height_depth(dim):
     pts = np.random.rand(100,dim)
     t = module[dim].Octree(pts, pts, 1)
@@ -67,3 +78,29 @@ def test_law_of_large_numbers():
         n_pts = child.end - child.start
         diff = np.abs(n_pts - (n / 8));
         assert(diff < (n / 16));
+
+def test_kdtree_orig_idxs(dim):
+    pts = np.random.rand(1000,dim)
+    t = module[dim].KDTree(pts, pts, 50)
+    np.testing.assert_almost_equal(np.array(t.pts), pts[np.array(t.orig_idxs), :])
+
+def test_duplicate_pts(dim):
+    pts = np.vstack((np.random.rand(100,dim), np.full((1000,dim), 0.3)))
+    t = module[dim].Octree(pts, pts, 1)
+    assert(t.max_height < 30)
+    assert(max([n.end - n.start for n in t.nodes if n.is_leaf]) == 1000)
+
+def test_max_depth(dim):
+    pts = np.random.rand(1000,dim)
+    t = module[dim].Octree(pts, pts, 1, max_depth = 2)
+    assert(t.max_height == 2)
+
+def test_level_order(dim):
+    pts = np.random.rand(1000,dim)
+    t = module[dim].Octree(pts, pts, 10)
+    depths = [n.depth for n in t.nodes]
+    assert(depths == sorted(depths))
+    assert(t.level_starts[-1] == len(t.nodes))
+    for n in t.nodes:
+        if not n.is_leaf:
+            assert(n.children == list(range(n.first_child, n.first_child + 2 ** dim)))
@@ -0,0 +1,74 @@
+#include <cstdio>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+#include "op_cache.hpp"
+#include "doctest.h"
+
+TEST_CASE("op cache stores and maps operators") {
+    char dir_template[] = "/tmp/op_cache_testXXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    OpCache cache(dir);
+    std::vector<double> values{1.0, -2.5, 3.25};
+
+    int n_builds = 0;
+    auto build = [&] () { n_builds++; return values; };
+    auto first = cache.get("op a", build);
+    REQUIRE(!first.mapped());
+    auto second = cache.get("op a", build);
+    REQUIRE(second.mapped());
+    REQUIRE(n_builds == 1);
+    REQUIRE(std::vector<double>(second.data(), second.data() + second.size()) == values);
+
+    auto other = cache.get("op b", [] () { return std::vector<double>{4.0}; });
+    REQUIRE(other.size() == 1);
+    REQUIRE(cache.path("op a") != cache.path("op b"));
+
+    std::remove(cache.path("op a").c_str());
+    std::remove(cache.path("op b").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("op cache rejects a file with a different key") {
+    char dir_template[] = "/tmp/op_cache_testXXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    OpCache cache(dir);
+    cache.get("op a", [] () { return std::vector<double>{1.0}; });
+    std::rename(cache.path("op a").c_str(), cache.path("op b").c_str());
+    auto op = cache.get("op b", [] () { return std::vector<double>{2.0, 3.0}; });
+    REQUIRE(!op.mapped());
+    REQUIRE(op.size() == 2);
+    REQUIRE(cache.get("op b", [] () { return std::vector<double>(); }).mapped());
+
+    std::remove(cache.path("op b").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("disabled op cache builds every time") {
+    OpCache cache("");
+    REQUIRE(!cache.enabled());
+    REQUIRE(!cache.get("op", [] () { return std::vector<double>{1.0}; }).mapped());
+}
+
+TEST_CASE("op cache creates missing parent directories") {
+    char dir_template[] = "/tmp/op_cache_testXXXXXX";
+    std::string root = mkdtemp(dir_template);
+    std::string dir = root + "/a/b";
+    OpCache cache(dir);
+    REQUIRE(!cache.get("op", [] () { return std::vector<double>{1.0}; }).mapped());
+    REQUIRE(cache.get("op", [] () { return std::vector<double>(); }).mapped());
+
+    std::remove(cache.path("op").c_str());
+    rmdir(dir.c_str());
+    rmdir((root + "/a").c_str());
+    rmdir(root.c_str());
+}
+
+TEST_CASE("op cache reports a directory it can't create") {
+    char file_template[] = "/tmp/op_cache_testXXXXXX";
+    int fd = mkstemp(file_template);
+    close(fd);
+    std::string file = file_template;
+    REQUIRE_THROWS_AS(OpCache(file + "/ops"), const std::runtime_error&);
+    std::remove(file.c_str());
+}
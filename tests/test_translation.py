@@ -21,3 +21,23 @@ def test_c2e_solve_relations():
     b2 = fmm.two.Cube([0,0], scale)
     op2 = np.array(fmm.two.c2e_solve(s, b2, 3.0, 1.1, cfg)) / scale
     np.testing.assert_almost_equal(op2, op)
+
+def test_c2e_homogeneous():
+    np.random.seed(10)
+    pts = np.random.rand(2000, 3)
+    ns = pts / np.linalg.norm(pts, axis = 1)[:,np.newaxis]
+    order = 64
+    tree = fmm.three.Octree(pts, ns, order)
+    cfg = fmm.three.FMMConfig(1.1, 2.6, order, "laplaceS3", [])
+    fmm_mat = fmm.three.fmmmmmmm(tree, tree, cfg)
+
+    surf = fmm.three.surrounding_surface(order)
+    assert(len(fmm_mat.u2e_ops) == len(surf) ** 2)
+    deepest = max(tree.nodes, key = lambda n: n.bounds_level)
+    assert(deepest.bounds_level > 0)
+    op = np.array(fmm.three.c2e_solve(
+        surf, fmm.three.Cube(deepest.bounds.center, deepest.bounds.width),
+        cfg.outer_r, cfg.inner_r, cfg
+    )).flatten()
+    scaled = fmm_mat.u2e_scales[deepest.bounds_level] * fmm_mat.u2e_ops
+    np.testing.assert_almost_equal(op / np.max(np.abs(op)), scaled / np.max(np.abs(op)))